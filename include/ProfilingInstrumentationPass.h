@@ -6,32 +6,88 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/Allocator.h"
 // temp
 #include "llvm/Support/raw_ostream.h"
 
 namespace cgprofiler {
 
 
+// source location of an instrumented call site, identified by its caller
+// and the ordinal of the call site within the caller
+// names refer to the instrumented module and live as long as it does
+struct SiteLocation
+{
+	llvm::StringRef caller;
+	uint32_t site;
+	llvm::StringRef filename;
+	uint32_t line;
+};
+
+
 struct ProfilingInstrumentationPass : public llvm::ModulePass {
 	static char ID;
 
 	// uniquely and dynamically enumerate internally implemented functions
 	llvm::DenseMap<llvm::Function*, uint64_t> impls;
 
-	ProfilingInstrumentationPass()
-	: llvm::ModulePass(ID) {}
+	// enumerate called external functions after internally implemented ones
+	llvm::DenseMap<llvm::Function*, uint64_t> externs;
+
+	// when set, line info is kept out of the edge table and only collected
+	// into siteLocations so that it can be symbolized when profile is written
+	bool lazySymbols;
+
+	// when set, direct calls within a recursive cycle of the static call graph
+	// only bump a recursion depth instead of pushing a shadow stack frame
+	bool collapseRecursion;
+
+	// when set, hooks only run while the runtime has enabled profiling: call
+	// site hooks while the caller's guard is set, frames while any guard is
+	bool guardHooks;
+
+	// strongly connected component of each function in a recursive cycle
+	llvm::DenseMap<llvm::Function*, uint64_t> recursive;
+
+	// debug locations of every instrumented call site that has one
+	std::vector<SiteLocation> siteLocations;
+
+	ProfilingInstrumentationPass(bool lazy = false, bool collapse = false,
+		bool guard = false)
+	: llvm::ModulePass(ID), lazySymbols(lazy), collapseRecursion(collapse),
+	guardHooks(guard) {}
 
 	bool runOnModule(llvm::Module& m) override; // instrumentation pass entrance
 
+	// shown by -time-passes
+	const char* getPassName() const override
+	{
+		return "Call graph profiling instrumentation";
+	}
+
 private:
+	// constant strings shared by every use of the same name in the module
+	llvm::StringMap<llvm::Constant*, llvm::BumpPtrAllocator> strings;
+
 	void initInternals (llvm::Module& m);
 
-	std::vector<llvm::StringRef> handleCallees (llvm::CallSite cs,
-		std::function<void(llvm::IRBuilder<>&, size_t)> injectCall);
+	void initRecursion (llvm::Module& m);
+
+	// whether the call from caller to callee stays within a recursive cycle
+	bool isRecursiveCall (llvm::Function* caller, llvm::Function* callee) const;
+
+	// number of call instructions in internally implemented functions
+	size_t countCallSites () const;
+
+	llvm::Constant* getConstantString (llvm::Module& m, llvm::StringRef str);
+
+	template <typename InjectFn>
+	uint64_t handleCallees (llvm::CallSite cs, InjectFn&& injectCall);
 };
 
 
@@ -1,9 +1,14 @@
 #include <iostream>
 
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CallGraph.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "ProfilingInstrumentationPass.h"
@@ -18,23 +23,25 @@ namespace cgprofiler
 char ProfilingInstrumentationPass::ID = 0;
 
 
-struct debugInfoNotFound : std::exception
-{
-	const char* what() const noexcept
-	{
-		return "input file does not contain debug info necessary to analysize line info";
-	}
-};
-
-
 enum CALLCASE
 {
 	EXTERNAL = 0,
 	DIRECT,
-	FUNCPTR
+	FUNCPTR,
+	RECURSIVE
 };
 
 
+// recursion depth histogram buckets per function, must match the runtime
+static const uint64_t RECURSION_BUCKETS = 32;
+
+
+// callee column of function pointer call sites, must match the runtime
+static const uint64_t ANY_CALLEE = ~0ULL;
+// returned when an instruction isn't a call edge to record
+static const uint64_t NO_CALLEE = ANY_CALLEE - 1;
+
+
 // helper function for creating a constant string accessible at runtime
 static Constant* createConstantString(Module& m, StringRef str)
 {
@@ -53,26 +60,208 @@ static Constant* createConstantString(Module& m, StringRef str)
 }
 
 
-static Constant* getFilename(Module& m, Instruction& inst)
+// filename of the call site, falls back to module name without debug info
+static StringRef getFilename(Module& m, Instruction& inst)
 {
 	const DebugLoc& loc = inst.getDebugLoc();
-	StringRef fname = m.getName();
 	if (loc) {
-		fname = loc->getFilename();
+		return loc->getFilename();
 	}
-	return createConstantString(m, fname);
+	return m.getName();
 }
 
 
-static Constant* getLineNumber(Module& m, Instruction& inst)
+// line number of the call site, 0 if line isn't known
+// (line numbers start from 1)
+static uint32_t getLineNumber(Instruction& inst)
 {
-	auto& context = m.getContext();
 	const DebugLoc& loc = inst.getDebugLoc();
 	if (loc) {
-		unsigned line = loc.getLine(); // line numbers start from 1
-		return ConstantInt::get(Type::getInt32Ty(context), line);
+		return loc.getLine();
+	}
+	return 0;
+}
+
+
+// pointer to the first element of a global array
+static Constant* getArrayStart(Module& m, ArrayType* arrayTy, GlobalVariable* array)
+{
+	auto* zero = ConstantInt::get(Type::getInt32Ty(m.getContext()), 0);
+	Value* indices[] = {zero, zero};
+	return ConstantExpr::getInBoundsGetElementPtr(arrayTy, array, indices);
+}
+
+
+// zero initialized counters accessible at runtime
+static GlobalVariable* createCounters(Module& m, uint64_t n)
+{
+	auto* arrayTy = ArrayType::get(Type::getInt64Ty(m.getContext()), n);
+	return new GlobalVariable(m, arrayTy, false, GlobalValue::PrivateLinkage,
+		ConstantAggregateZero::get(arrayTy));
+}
+
+
+// whether a guard flag set by the runtime is on, the runtime flips it
+// at any time so it is read with a relaxed atomic load
+static Value* loadGuard(IRBuilder<>& builder, Constant* flag)
+{
+	LoadInst* load = builder.CreateLoad(flag);
+	load->setAlignment(1);
+	load->setAtomic(AtomicOrdering::Monotonic);
+	return builder.CreateICmpNE(load, builder.getInt8(0));
+}
+
+
+// only run hook when cond holds, guarded hooks are expected to be disabled
+// most of the time
+static void guardCall(Instruction* hook, Value* cond)
+{
+	MDBuilder weights(hook->getContext());
+	TerminatorInst* then = SplitBlockAndInsertIfThen(cond, hook, false,
+		weights.createBranchWeights(1, 1000));
+	hook->moveBefore(then);
+}
+
+
+// push a shadow stack frame at function entry and pop it at every exit
+// control coming back through a landing pad or a second return of setjmp
+// skipped the exits of the frames above, so the stack is resynced there
+// with an active flag, frames are only pushed while it is set and a depth
+// of 0 marks a frame that wasn't pushed
+static void instrumentFrame(llvm::Function& f, Constant* module, uint64_t id,
+	Constant* enterCall, Constant* leaveCall, Constant* resyncCall,
+	Constant* active)
+{
+	// collect insertion points first since instrumenting adds instructions
+	SmallVector<Instruction*, 8> exits;
+	SmallVector<Instruction*, 8> reentries;
+	for (auto& bb : f)
+	{
+		Instruction* term = bb.getTerminator();
+		if (isa<ReturnInst>(term) || isa<ResumeInst>(term))
+		{
+			// nothing may come between a musttail call and its return
+			auto* tail = dyn_cast_or_null<CallInst>(term->getPrevNode());
+			Instruction* exit = term;
+			if (tail && tail->isMustTailCall())
+			{
+				// the callee replaces this frame, so the frame is popped before
+				// the call site's hook marks the frame the callee returns to
+				auto* hook = dyn_cast_or_null<CallInst>(tail->getPrevNode());
+				llvm::Function* hooked = hook ? hook->getCalledFunction() : nullptr;
+				bool isHook = hooked && hooked->getName().startswith("CaLlPrOfIlEr_");
+				exit = isHook ? hook : tail;
+			}
+			exits.push_back(exit);
+		}
+		if (bb.isLandingPad())
+		{
+			reentries.push_back(&*bb.getFirstInsertionPt());
+		}
+		for (auto& stmt : bb)
+		{
+			auto* call = dyn_cast<CallInst>(&stmt);
+			if (call && call->hasFnAttr(Attribute::ReturnsTwice))
+			{
+				reentries.push_back(call->getNextNode());
+			}
+		}
+	}
+
+	// guards branch around the entry, so keep the allocas in the entry block
+	Instruction* entry = &*f.getEntryBlock().getFirstInsertionPt();
+	while (active && isa<AllocaInst>(entry))
+	{
+		entry = entry->getNextNode();
+	}
+	IRBuilder<> builder(entry);
+	// registers aren't restored by longjmp, so keep the depth in memory
+	AllocaInst* slot = nullptr;
+	if (f.callsFunctionThatReturnsTwice())
+	{
+		slot = builder.CreateAlloca(builder.getInt64Ty());
+	}
+	Value* isActive = active ? loadGuard(builder, active) : nullptr;
+	Instruction* entered = builder.CreateCall(enterCall, {module, builder.getInt64(id)});
+	Value* depth = entered;
+	if (active)
+	{
+		BasicBlock* inactive = entered->getParent();
+		guardCall(entered, isActive);
+		PHINode* phi = PHINode::Create(builder.getInt64Ty(), 2, "",
+			&entry->getParent()->front());
+		phi->addIncoming(entered, entered->getParent());
+		phi->addIncoming(builder.getInt64(0), inactive);
+		depth = phi;
+		builder.SetInsertPoint(entry);
+	}
+	if (slot)
+	{
+		builder.CreateStore(depth, slot, true);
+	}
+
+	for (auto* exit : exits)
+	{
+		IRBuilder<> exitBuilder(exit);
+		Value* pushed = active ? exitBuilder.CreateICmpNE(depth, exitBuilder.getInt64(0)) : nullptr;
+		Instruction* left = exitBuilder.CreateCall(leaveCall, depth);
+		if (active)
+		{
+			guardCall(left, pushed);
+		}
+	}
+	for (auto* reentry : reentries)
+	{
+		IRBuilder<> reentryBuilder(reentry);
+		Value* resumed = slot ? reentryBuilder.CreateLoad(slot, true) : depth;
+		Value* pushed = active ? reentryBuilder.CreateICmpNE(resumed, reentryBuilder.getInt64(0)) : nullptr;
+		Instruction* resynced = reentryBuilder.CreateCall(resyncCall, resumed);
+		if (active)
+		{
+			guardCall(resynced, pushed);
+		}
+	}
+}
+
+
+// internal function calling a runtime hook with the module descriptor
+static llvm::Function* createModuleHook(Module& m, StringRef name,
+	Constant* hook, Constant* module)
+{
+	auto* fnTy = FunctionType::get(Type::getVoidTy(m.getContext()), false);
+	auto* f = llvm::Function::Create(fnTy, GlobalValue::InternalLinkage, name, &m);
+	IRBuilder<> builder(BasicBlock::Create(m.getContext(), "entry", f));
+	builder.CreateCall(hook, module);
+	builder.CreateRetVoid();
+	return f;
+}
+
+
+Constant* ProfilingInstrumentationPass::getConstantString(Module& m, StringRef str)
+{
+	Constant*& entry = strings[str];
+	if (!entry)
+	{
+		entry = createConstantString(m, str);
+	}
+	return entry;
+}
+
+
+size_t ProfilingInstrumentationPass::countCallSites() const
+{
+	size_t n = 0;
+	for (auto f_imps : impls)
+	{
+		for (auto& bb: *f_imps.first)
+		{
+			for (auto& stmt : bb)
+			{
+				n += isa<CallInst>(stmt) || isa<InvokeInst>(stmt);
+			}
+		}
 	}
-	return nullptr;
+	return n;
 }
 
 
@@ -80,162 +269,315 @@ bool ProfilingInstrumentationPass::runOnModule(Module& m)
 {
 	auto& context = m.getContext();
 	initInternals(m);
+	if (collapseRecursion)
+	{
+		initRecursion(m);
+	}
+	strings.clear();
 
-	// Create the component types of the table
+	// size edge bookkeeping up front so that it isn't regrown per call site
+	size_t numCalls = countCallSites();
+	siteLocations.reserve(numCalls);
+
+	// Create the component types of the tables
 	auto* voidTy = Type::getVoidTy(context);
 	auto* int64Ty = Type::getInt64Ty(context);
 	auto* stringTy = Type::getInt8PtrTy(context);
-	Type* fieldTys[] = {stringTy, stringTy, Type::getInt32Ty(context), stringTy, int64Ty};
+	auto* int32Ty = Type::getInt32Ty(context);
+	// call site row: caller, filename, line, call site ordinal, callee column, first cell
+	Type* fieldTys[] = {stringTy, stringTy, int32Ty, int32Ty, int64Ty, int64Ty};
 	auto* structTy = StructType::get(context, fieldTys, false);
 
+	// module descriptor: call site rows, column names, number of internal
+	// columns, matrix cells, entry counters, recursion histograms, guards,
+	// unattributed entry counters and flags of functions only called directly
+	auto* int64PtrTy = Type::getInt64PtrTy(context);
+	Type* moduleFieldTys[] = {
+		structTy->getPointerTo(), int64Ty,
+		stringTy->getPointerTo(), int64Ty, int64Ty,
+		int64PtrTy, int64Ty,
+		int64PtrTy,
+		int64PtrTy,
+		stringTy,
+		int64PtrTy,
+		stringTy
+	};
+	auto* moduleTy = StructType::get(context, moduleFieldTys, false);
+	// private to the module so that every instrumented executable and shared
+	// library has its own, hooks are told which one they update
+	auto* moduleInfo = new GlobalVariable(m,
+        moduleTy, true,
+        GlobalValue::PrivateLinkage,
+        nullptr, "CaLlPrOfIlEr_module");
+	auto* module = ConstantExpr::getBitCast(moduleInfo, stringTy);
+
 	auto* intSetterTy = FunctionType::get(voidTy, int64Ty, false);
-	// increment CaLlPrOfIlEr_edgeInfo[input] frequency
-	auto externalCall = m.getOrInsertFunction("CaLlPrOfIlEr_calling", intSetterTy);
-	// push edgeInfo index into runtime call stack
-	auto directCall = m.getOrInsertFunction("CaLlPrOfIlEr_funcPush", intSetterTy);
-	auto ptrCall = m.getOrInsertFunction("CaLlPrOfIlEr_funcRangePush", intSetterTy);
-
-	// initial value of call frequency
-	auto* zero = ConstantInt::get(int64Ty, 0, false);
-
-    // identify and record all function calls within modules into edges
-    // to node is denoted by callee, and it is the name of the calling statement (unless it's a function pointer)
-    //      in cases of function pointers, we have to rely on the function name provided at runtime
-    //      in cases of external function calls, we have to rely on statement name at function call
-    //      in all cases, each calling statement is given a unique value
+	auto* rowSetterTy = FunctionType::get(voidTy, {stringTy, int64Ty}, false);
+	// mark the call site row of the next internal function entry
+	auto siteCall = m.getOrInsertFunction("CaLlPrOfIlEr_site", rowSetterTy);
+	// increment the single cell of an external call site row, its callee is
+	// known here so the runtime doesn't check the column
+	auto edgeCall = m.getOrInsertFunction("CaLlPrOfIlEr_edge", rowSetterTy);
+	// increment the cell of a call within a recursive cycle, and let the
+	// callee's entry deepen the caller's frame instead of pushing its own
+	auto recurseCall = m.getOrInsertFunction("CaLlPrOfIlEr_recurse", rowSetterTy);
+
+	// guards of internal functions ordered by id, the runtime sets them to
+	// enable profiling the function's call sites and sets the active flag
+	// while any guard is set
+	GlobalVariable* guards = nullptr;
+	Constant* active = nullptr;
+	SmallVector<std::pair<Instruction*, uint64_t>, 64> guardedHooks;
+	if (guardHooks)
+	{
+		auto* guardsTy = ArrayType::get(Type::getInt8Ty(context), impls.size());
+		guards = new GlobalVariable(m, guardsTy, false, GlobalValue::PrivateLinkage,
+			ConstantAggregateZero::get(guardsTy));
+		active = m.getOrInsertGlobal("CaLlPrOfIlEr_active", Type::getInt8Ty(context));
+		guardedHooks.reserve(numCalls);
+	}
+
+    // identify and record all function calls within modules into a sparse
+    // matrix of call site rows and callee columns
+    // columns are internally implemented functions followed by external callees
+    //      in cases of function pointers, the row holds a cell for every internal function
+    //      in all other cases, the row holds a single cell for its callee
+    // the callee's entry counts the edge for internal calls, the call site itself for external calls
     // from node is denoted by function name containing the function call
     // also ignore all llvm.dbg
-	std::vector<Constant*> edges;
+    // call sites without debug info are identified by (caller, call site ordinal)
+	SmallVector<Constant*, 64> sites;
+	sites.reserve(numCalls);
+	uint64_t numCells = 0;
 	// We only want to instrument internally implemented functions, so we take impls instead.
 	for (auto f_imps : impls)
 	{
 		llvm::Function* funk = f_imps.first;
-		Constant* caller = createConstantString(m, funk->getName());
+		Constant* caller = getConstantString(m, funk->getName());
+		uint32_t site = 0;
 		for (auto& bb: *funk)
 		{
-        	for (auto& stmt : bb)
+			for (auto& stmt : bb)
 			{
-				std::vector<StringRef> callees = handleCallees(CallSite(&stmt),
-					[&edges, externalCall, directCall, ptrCall]
-					(IRBuilder<>& builder, size_t callcase)
+				uint64_t callee = handleCallees(CallSite(&stmt),
+					[&sites, &guardedHooks, guards, module, siteCall, edgeCall,
+						recurseCall, f_imps]
+					(IRBuilder<>& builder, size_t callcase, uint64_t)
 				{
-					size_t currentIdx = edges.size();
+					size_t currentIdx = sites.size();
+					Instruction* hook = nullptr;
 					switch(callcase)
 					{
 						case EXTERNAL:
-							builder.CreateCall(externalCall, builder.getInt64(currentIdx));
+							hook = builder.CreateCall(edgeCall, {module,
+								builder.getInt64(currentIdx)});
 							break;
-						case DIRECT:
-							builder.CreateCall(directCall, builder.getInt64(currentIdx));
+						case RECURSIVE:
+							hook = builder.CreateCall(recurseCall, {module,
+								builder.getInt64(currentIdx)});
 							break;
+						case DIRECT:
 						case FUNCPTR:
-							builder.CreateCall(ptrCall, builder.getInt64(currentIdx));
+							hook = builder.CreateCall(siteCall, {module,
+								builder.getInt64(currentIdx)});
 							break;
 					}
-				});
-				// callee is empty is stmt isn't a call or an edge we should record
-				if (!callees.empty())
-				{
-					Constant* filename = getFilename(m, stmt);
-					Constant* line = getLineNumber(m, stmt);
-					if (!line)
-					{
-						throw debugInfoNotFound();
-					}
-					for (StringRef callname : callees)
+					// guarded after the walk, guards split the block being walked
+					if (guards)
 					{
-						Constant* callee = createConstantString(m, callname);
-						Constant *structFields[] = {
-							caller, filename, line, callee, zero
-						};
-						edges.push_back(ConstantStruct::get(structTy, structFields));
+						guardedHooks.push_back(std::make_pair(hook, f_imps.second));
 					}
+				});
+				// stmt isn't a call or an edge we should record
+				if (NO_CALLEE == callee)
+				{
+					continue;
+				}
+				StringRef fname = getFilename(m, stmt);
+				uint32_t lino = getLineNumber(stmt);
+				if (lino)
+				{
+					siteLocations.push_back(
+						SiteLocation{funk->getName(), site, fname, lino});
+				}
+				if (lazySymbols)
+				{
+					// leave symbolization to the runtime
+					fname = m.getName();
+					lino = 0;
 				}
+				Constant *structFields[] = {
+					caller,
+					getConstantString(m, fname),
+					ConstantInt::get(int32Ty, lino),
+					ConstantInt::get(int32Ty, site),
+					ConstantInt::get(int64Ty, callee),
+					ConstantInt::get(int64Ty, numCells)
+				};
+				sites.push_back(ConstantStruct::get(structTy, structFields));
+				numCells += ANY_CALLEE == callee ? impls.size() : 1;
+				++site;
 			}
 		}
 	}
 
-	auto popCallStack = m.getOrInsertFunction("CaLlPrOfIlEr_funcPop",
-		FunctionType::get(voidTy, int64Ty, false));
+	// count the entry, and the edge from the marked call site row if it has
+	// this column, then push a shadow stack frame returning the new depth
+	auto enterCall = m.getOrInsertFunction("CaLlPrOfIlEr_enter",
+		FunctionType::get(int64Ty, {stringTy, int64Ty}, false));
+	// pop the shadow stack frame at the given depth
+	auto leaveCall = m.getOrInsertFunction("CaLlPrOfIlEr_leave", intSetterTy);
+	// drop shadow stack frames above the given depth
+	auto resyncCall = m.getOrInsertFunction("CaLlPrOfIlEr_resync", intSetterTy);
 	for (auto f_imps : impls)
 	{
-		llvm::Function* funk = f_imps.first;
-		IRBuilder<> builder(&*funk->getEntryBlock().getFirstInsertionPt());
-		// pop edgeInfo index from call stack, adding id to index iff the edgeInfo index is pushed from callfrange
-		builder.CreateCall(popCallStack, builder.getInt64(impls[funk]));
+		instrumentFrame(*f_imps.first, module, f_imps.second,
+			enterCall, leaveCall, resyncCall, active);
 	}
 
-	// inject the result printing function so that it prints out the counts after
-	// the entire program is finished executing.
-	auto* printer = m.getOrInsertFunction("CaLlPrOfIlEr_print", voidTy, nullptr);
-	appendToGlobalDtors(m, cast<llvm::Function>(printer), 0);
+	// call site hooks run while the caller's guard is set
+	for (auto& hook : guardedHooks)
+	{
+		IRBuilder<> builder(hook.first);
+		Constant* indices[] = {builder.getInt32(0), builder.getInt32(hook.second)};
+		Constant* guard = ConstantExpr::getInBoundsGetElementPtr(
+			guards->getValueType(), guards, indices);
+		guardCall(hook.first, loadGuard(builder, guard));
+	}
+
+	// register the module with the runtime when it is loaded, and unregister
+	// it when it is unloaded by dlclose or at exit. The runtime snapshots the
+	// counts of unloaded modules and prints them all once every module is gone.
+	auto* moduleHookTy = FunctionType::get(voidTy, stringTy, false);
+	appendToGlobalCtors(m, createModuleHook(m, "CaLlPrOfIlEr_registerModule",
+		m.getOrInsertFunction("CaLlPrOfIlEr_register", moduleHookTy), module), 0);
+	appendToGlobalDtors(m, createModuleHook(m, "CaLlPrOfIlEr_unregisterModule",
+		m.getOrInsertFunction("CaLlPrOfIlEr_unregister", moduleHookTy), module), 0);
 
 	// Global variables
-	auto* tableTy = ArrayType::get(structTy, edges.size());
-	auto* functionTable = ConstantArray::get(tableTy, edges);
-	new GlobalVariable(m,
-        tableTy, false,
-        GlobalValue::ExternalLinkage,
-        functionTable, "CaLlPrOfIlEr_edgeInfo");
-
-	auto* numEdgesGlobal = ConstantInt::get(int64Ty, edges.size(), false);
-	new GlobalVariable(m,
-        int64Ty, true,
-        GlobalValue::ExternalLinkage,
-        numEdgesGlobal, "CaLlPrOfIlEr_numEdges");
+	auto* tableTy = ArrayType::get(structTy, sites.size());
+	auto* siteTable = new GlobalVariable(m,
+        tableTy, true,
+        GlobalValue::PrivateLinkage,
+        ConstantArray::get(tableTy, sites));
+
+	// column names: internal functions ordered by id, then external callees
+	SmallVector<Constant*, 64> columns(impls.size() + externs.size());
+	for (auto imp : impls)
+	{
+		columns[imp.second] = getConstantString(m, imp.first->getName());
+	}
+	for (auto ext : externs)
+	{
+		columns[ext.second] = getConstantString(m, ext.first->getName());
+	}
+	auto* namesTy = ArrayType::get(stringTy, columns.size());
+	auto* funcTable = new GlobalVariable(m,
+        namesTy, true,
+        GlobalValue::PrivateLinkage,
+        ConstantArray::get(namesTy, columns));
+
+	auto* cells = createCounters(m, numCells);
+	auto* entries = createCounters(m, impls.size());
+	auto* unattributed = createCounters(m, impls.size());
+	// internal functions only ever called directly from this module: no
+	// other module, external code or the loader can enter them, so the
+	// runtime reports any of their entries left unattributed
+	auto* int8Ty = Type::getInt8Ty(context);
+	SmallVector<Constant*, 64> directFlags(impls.size());
+	for (auto imp : impls)
+	{
+		bool direct = imp.first->hasLocalLinkage() && !imp.first->hasAddressTaken();
+		directFlags[imp.second] = ConstantInt::get(int8Ty, direct);
+	}
+	auto* directTy = ArrayType::get(int8Ty, directFlags.size());
+	auto* directOnly = new GlobalVariable(m,
+        directTy, true,
+        GlobalValue::PrivateLinkage,
+        ConstantArray::get(directTy, directFlags));
+	Constant* recursion = ConstantPointerNull::get(int64PtrTy);
+	Constant* guardTable = ConstantPointerNull::get(stringTy);
+	if (guards)
+	{
+		guardTable = getArrayStart(m, cast<ArrayType>(guards->getValueType()), guards);
+	}
+	if (collapseRecursion)
+	{
+		auto* histograms = createCounters(m, impls.size() * RECURSION_BUCKETS);
+		recursion = getArrayStart(m,
+			cast<ArrayType>(histograms->getValueType()), histograms);
+	}
+
+	// module descriptor holding the matrix
+	Constant* moduleFields[] = {
+		getArrayStart(m, tableTy, siteTable),
+		ConstantInt::get(int64Ty, sites.size()),
+		getArrayStart(m, namesTy, funcTable),
+		ConstantInt::get(int64Ty, columns.size()),
+		ConstantInt::get(int64Ty, impls.size()),
+		getArrayStart(m, cast<ArrayType>(cells->getValueType()), cells),
+		ConstantInt::get(int64Ty, numCells),
+		getArrayStart(m, cast<ArrayType>(entries->getValueType()), entries),
+		recursion,
+		guardTable,
+		getArrayStart(m, cast<ArrayType>(unattributed->getValueType()), unattributed),
+		getArrayStart(m, directTy, directOnly)
+	};
+	moduleInfo->setInitializer(ConstantStruct::get(moduleTy, moduleFields));
 
 	return true;
 }
 
 
-std::vector<StringRef> ProfilingInstrumentationPass::handleCallees (CallSite cs,
-	std::function<void(IRBuilder<>&, size_t)> injectCall)
+template <typename InjectFn>
+uint64_t ProfilingInstrumentationPass::handleCallees (CallSite cs,
+	InjectFn&& injectCall)
 {
 	// Check whether the instruction is actually a function call
 	if (!cs.getInstruction())
 	{
-		return std::vector<StringRef>();
+		return NO_CALLEE;
 	}
 
-	IRBuilder<> builder(cs.getInstruction());
-	std::vector<StringRef> callees;
 	auto directCall = dyn_cast<llvm::Function>(cs.getCalledValue()->stripPointerCasts());
-	// for all injected function calls, argument is the starting index of the edge info being inserted
-	if (directCall)
+	// ignore llvm.dbg.*
+	if (directCall && directCall->getName().startswith("llvm.dbg."))
 	{
-		// store callee name
-		StringRef callname = directCall->getName();
-		// ignore llvm.dbg.*
-		if (0 == std::string(callname.data()).compare(0, 9, "llvm.dbg."))
-			return std::vector<StringRef>();
+		return NO_CALLEE;
+	}
 
-		callees.push_back(callname);
+	IRBuilder<> builder(cs.getInstruction());
+	// for all injected function calls, argument is the call site row being inserted
+	if (!directCall) // call is a function pointer call
+	{
+		// row holds a cell for every internally implemented function ordered by id
+		injectCall(builder, FUNCPTR, ANY_CALLEE);
+		return ANY_CALLEE;
+	}
 
-		// inject function calls
-		if (!impls.count(directCall)) // external function calls
-		{
-			injectCall(builder, EXTERNAL);
-		}
-		else // internal function calls
-		{
-			injectCall(builder, DIRECT);
-		}
+	auto internal = impls.find(directCall);
+	if (internal != impls.end()) // internal function calls
+	{
+		bool recursiveCall = collapseRecursion &&
+			isRecursiveCall(cs.getCaller(), directCall);
+		injectCall(builder, recursiveCall ? RECURSIVE : DIRECT, internal->second);
+		return internal->second;
 	}
-	else // call is a function pointer call
+
+	// external function calls get columns after all internal functions
+	auto external = externs.find(directCall);
+	uint64_t column;
+	if (external == externs.end())
 	{
-		// callees must be internally implemented functions ordered by id, so pad with nulls
-		// then inject info in the correct id order
-		callees.insert(callees.end(), impls.size(), StringRef());
-		for (auto imp : impls)
-		{
-			llvm::Function* f = imp.first;
-			uint64_t id = imp.second;
-			callees[id] = f->getName();
-		}
-		// inject function calls
-		injectCall(builder, FUNCPTR);
+		column = impls.size() + externs.size();
+		externs[directCall] = column;
 	}
-	return callees;
+	else
+	{
+		column = external->second;
+	}
+	injectCall(builder, EXTERNAL, column);
+	return column;
 }
 
 
@@ -252,4 +594,40 @@ void ProfilingInstrumentationPass::initInternals (Module& m)
 	}
 }
 
+void ProfilingInstrumentationPass::initRecursion (Module& m)
+{
+	recursive.clear();
+	CallGraph cg(m);
+	uint64_t nextID = 0;
+	// a component is recursive if it has a cycle, including self loops
+	for (auto scc = scc_begin(&cg); !scc.isAtEnd(); ++scc)
+	{
+		if (!scc.hasLoop())
+		{
+			continue;
+		}
+		for (CallGraphNode* node : *scc)
+		{
+			if (llvm::Function* f = node->getFunction())
+			{
+				recursive[f] = nextID;
+			}
+		}
+		++nextID;
+	}
+}
+
+
+bool ProfilingInstrumentationPass::isRecursiveCall (llvm::Function* caller,
+	llvm::Function* callee) const
+{
+	auto from = recursive.find(caller);
+	if (from == recursive.end())
+	{
+		return false;
+	}
+	auto to = recursive.find(callee);
+	return to != recursive.end() && from->second == to->second;
+}
+
 } // namespace cgprofiler
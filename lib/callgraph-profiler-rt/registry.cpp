@@ -0,0 +1,531 @@
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "runtime.h"
+
+// module registry and profile writing shared by every runtime variant
+
+namespace cgprofiler {
+
+
+// registered module, points at the module's own tables while it is loaded
+// and at a snapshot of them once it is unloaded
+struct registration
+{
+	std::atomic<const moduleInfo*> mod;
+	const moduleInfo* loaded;
+	// prefix of caller names, empty for the main executable
+	std::string library;
+	// file name of the executable or shared library, keys its site map
+	std::string object;
+	// hooks were guarded, toggling profiling within a call counts only
+	// half of it
+	bool guarded;
+	registration* next;
+};
+
+
+// lock-free registry of every module registered so far, newest first
+static std::atomic<registration*> registry(nullptr);
+// modules registered and not yet unregistered
+static std::atomic<uint64_t> liveModules(0);
+// guards of modules registered later are set as well
+static std::atomic<bool> enabledAll(false);
+
+
+// name modules by the file name of the object holding their descriptor,
+// callers are only prefixed by it within shared libraries
+static void nameModule(const moduleInfo* mod, registration& entry) {
+	Dl_info modObject, mainObject;
+	if (!dladdr(mod, &modObject) || !modObject.dli_fname) {
+		return;
+	}
+	const char* base = std::strrchr(modObject.dli_fname, '/');
+	entry.object = base ? base + 1 : modObject.dli_fname;
+	if (dladdr((void*) &liveTables, &mainObject) &&
+		modObject.dli_fbase != mainObject.dli_fbase) {
+		entry.library = entry.object + "!";
+	}
+}
+
+
+static char* copyString(std::map<const char*, char*>& copies, const char* str) {
+	char*& copy = copies[str];
+	if (!copy) {
+		copy = strdup(str);
+	}
+	return copy;
+}
+
+
+static uint64_t* copyCounters(const uint64_t* counters, uint64_t n) {
+	if (!counters) {
+		return nullptr;
+	}
+	uint64_t* copy = new uint64_t[n];
+	std::memcpy(copy, counters, n * sizeof(uint64_t));
+	return copy;
+}
+
+
+// copy a module's tables out of its soon unmapped memory
+static const moduleInfo* snapshot(const moduleInfo* mod) {
+	std::map<const char*, char*> copies;
+	auto* copy = new moduleInfo(*mod);
+	copy->sites = new siteInfo[mod->numSites];
+	for (uint64_t row = 0; row < mod->numSites; ++row) {
+		copy->sites[row] = mod->sites[row];
+		copy->sites[row].caller = copyString(copies, mod->sites[row].caller);
+		copy->sites[row].callmodule = copyString(copies, mod->sites[row].callmodule);
+	}
+	copy->funcs = new char*[mod->numFuncs];
+	for (uint64_t col = 0; col < mod->numFuncs; ++col) {
+		copy->funcs[col] = copyString(copies, mod->funcs[col]);
+	}
+	copy->cells = copyCounters(mod->cells, mod->numCells);
+	copy->entries = copyCounters(mod->entries, mod->numInternal);
+	copy->recursion = copyCounters(mod->recursion, mod->numInternal * RECURSION_BUCKETS);
+	copy->guards = nullptr;
+	copy->unattributed = copyCounters(mod->unattributed, mod->numInternal);
+	copy->directOnly = new uint8_t[mod->numInternal];
+	std::memcpy(copy->directOnly, mod->directOnly, mod->numInternal);
+	return copy;
+}
+
+
+// guarded functions enabled at startup by CALLPROFILER_ENABLE, either all
+// of them for "1" or a comma separated list of function names, and the
+// signal toggling all of them named by CALLPROFILER_TOGGLE_SIGNAL
+// read on first registration since modules register from their constructors
+struct startupGuards
+{
+	std::vector<std::string> functions;
+	int toggleSignal = 0;
+
+	startupGuards() {
+		if (const char* env = std::getenv("CALLPROFILER_ENABLE")) {
+			std::string names(env);
+			bool all = "1" == names || "all" == names;
+			enabledAll.store(all);
+			for (size_t start = 0; !all && start < names.size();) {
+				size_t end = std::min(names.find(',', start), names.size());
+				if (end > start) {
+					functions.push_back(names.substr(start, end - start));
+				}
+				start = end + 1;
+			}
+		}
+		if (const char* env = std::getenv("CALLPROFILER_TOGGLE_SIGNAL")) {
+			toggleSignal = std::atoi(env);
+		}
+	}
+};
+
+
+static const startupGuards& startup() {
+	static const startupGuards guards;
+	return guards;
+}
+
+
+static inline void setGuard(uint8_t& guard, bool on) {
+	__atomic_store_n(&guard, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+// guarded modules that are loaded, their guards are in their own memory
+static bool guardedAndLoaded(const registration* entry) {
+	return entry->loaded->guards && entry->mod.load() == entry->loaded;
+}
+
+
+// frames are entered while any guard of a loaded module is set
+static void updateActive() {
+	bool on = enabledAll.load();
+	for (registration* entry = registry.load(); entry && !on; entry = entry->next) {
+		if (!guardedAndLoaded(entry)) {
+			continue;
+		}
+		for (uint64_t col = 0; col < entry->loaded->numInternal && !on; ++col) {
+			on = entry->loaded->guards[col];
+		}
+	}
+	__atomic_store_n(&CGPROF(active), on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+// set the guards of the functions of mod named name, returns how many
+static uint64_t setFunctionGuards(const moduleInfo* mod, const char* name, bool on) {
+	uint64_t matched = 0;
+	for (uint64_t col = 0; col < mod->numInternal; ++col) {
+		if (0 == std::strcmp(mod->funcs[col], name)) {
+			setGuard(mod->guards[col], on);
+			++matched;
+		}
+	}
+	return matched;
+}
+
+
+static void toggleProfiling(int) {
+	CGPROF(enable)(!CGPROF(active));
+}
+
+
+moduleInfo* liveTables(const moduleInfo* mod) {
+	for (registration* entry = registry.load(); entry; entry = entry->next) {
+		if (entry->loaded == mod) {
+			return const_cast<moduleInfo*>(entry->mod.load());
+		}
+	}
+	return const_cast<moduleInfo*>(mod);
+}
+
+
+}
+
+
+using namespace cgprofiler;
+
+
+extern "C" {
+
+
+// set while any function of a guarded module is enabled, guarded modules
+// only enter frames while it is set
+uint8_t CGPROF(active) = 0;
+
+
+// shows up as method `CaLlPrOfIlEr_enable`
+// enable or disable profiling every guarded function, also of modules
+// registered later, safe to call from a signal handler
+void CGPROF(enable)(int on) {
+	enabledAll.store(on);
+	for (registration* entry = registry.load(); entry; entry = entry->next) {
+		if (!guardedAndLoaded(entry)) {
+			continue;
+		}
+		for (uint64_t col = 0; col < entry->loaded->numInternal; ++col) {
+			setGuard(entry->loaded->guards[col], on);
+		}
+	}
+	__atomic_store_n(&CGPROF(active), on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+// shows up as method `CaLlPrOfIlEr_enableFunction`
+// enable or disable profiling the call sites of guarded functions named
+// name in every loaded module, returns how many functions matched
+uint64_t CGPROF(enableFunction)(const char* name, int on) {
+	uint64_t matched = 0;
+	for (registration* entry = registry.load(); entry; entry = entry->next) {
+		if (guardedAndLoaded(entry)) {
+			matched += setFunctionGuards(entry->loaded, name, on);
+		}
+	}
+	updateActive();
+	return matched;
+}
+
+
+// shows up as method `CaLlPrOfIlEr_register`
+void CGPROF(register)(const moduleInfo* mod) {
+	const startupGuards& guards = startup();
+	auto* entry = new registration();
+	entry->mod.store(mod);
+	entry->loaded = mod;
+	nameModule(mod, *entry);
+	entry->guarded = nullptr != mod->guards;
+	entry->next = registry.load();
+	while (!registry.compare_exchange_weak(entry->next, entry)) {
+	}
+	++liveModules;
+
+	if (!mod->guards) {
+		return;
+	}
+	static bool signalInstalled = false;
+	if (guards.toggleSignal && !signalInstalled) {
+		signalInstalled = true;
+		std::signal(guards.toggleSignal, toggleProfiling);
+	}
+	bool all = enabledAll.load();
+	for (uint64_t col = 0; all && col < mod->numInternal; ++col) {
+		setGuard(mod->guards[col], true);
+	}
+	for (const std::string& name : guards.functions) {
+		setFunctionGuards(mod, name.c_str(), true);
+	}
+	updateActive();
+}
+
+
+void CGPROF(print)();
+
+
+// shows up as method `CaLlPrOfIlEr_unregister`
+// runs when the module is unloaded, either by dlclose or at exit, and
+// writes the profile once the last module is gone
+void CGPROF(unregister)(const moduleInfo* mod) {
+	flushCounts(mod);
+	for (registration* entry = registry.load(); entry; entry = entry->next) {
+		if (entry->loaded == mod && entry->mod.load() == mod) {
+			entry->mod.store(snapshot(mod));
+			break;
+		}
+	}
+	if (0 == --liveModules) {
+		CGPROF(print)();
+	}
+}
+
+
+}
+
+
+namespace cgprofiler {
+
+
+// registered modules in the order they were registered
+static std::vector<registration*> registeredModules() {
+	std::vector<registration*> modules;
+	for (registration* entry = registry.load(); entry; entry = entry->next) {
+		modules.insert(modules.begin(), entry);
+	}
+	return modules;
+}
+
+
+// check the counts of an unguarded module against each other
+// entries only count as unattributed when no cell counts them, so entries
+// and incoming edges only disagree where edges are counted at the call site
+// (calls within collapsed cycles) and the callee entered is another module's,
+// or where counts of other threads raced
+// functions only called directly from this module are always entered right
+// after one of its call sites is marked, so an unattributed entry of theirs
+// shows a call site the pass didn't hook or a mark the runtime lost
+static void checkInvariants(const moduleInfo& mod, const std::string& library,
+	bool guarded, std::ofstream& diagnostics) {
+	std::vector<uint64_t> incoming(mod.numInternal, 0);
+	for (uint64_t row = 0; row < mod.numSites; ++row) {
+		const siteInfo& info = mod.sites[row];
+		if (ANY_CALLEE == info.callee) {
+			for (uint64_t col = 0; col < mod.numInternal; ++col) {
+				incoming[col] += mod.cells[info.firstCell + col];
+			}
+		} else if (info.callee < mod.numInternal) {
+			incoming[info.callee] += mod.cells[info.firstCell];
+		}
+	}
+
+	for (uint64_t col = 0; col < mod.numInternal; ++col) {
+		uint64_t unattributed = mod.unattributed[col];
+		if (!guarded && incoming[col] + unattributed != mod.entries[col]) {
+			std::fprintf(stderr, "callgraph-profiler: %s%s has %llu incoming edges "
+				"and %llu unattributed entries but %llu entries\n", library.c_str(),
+				mod.funcs[col], (unsigned long long) incoming[col],
+				(unsigned long long) unattributed,
+				(unsigned long long) mod.entries[col]);
+		}
+		if (!guarded && mod.directOnly[col] && unattributed > 0) {
+			std::fprintf(stderr, "callgraph-profiler: %s%s is only called directly "
+				"but has %llu unattributed entries\n", library.c_str(),
+				mod.funcs[col], (unsigned long long) unattributed);
+		}
+		if (diagnostics.is_open()) {
+			diagnostics << library << mod.funcs[col] << ", "
+				<< mod.entries[col] << ", "
+				<< incoming[col] << ", "
+				<< unattributed << "\n";
+		}
+	}
+}
+
+
+// write the recursion depth histograms to profile-recursion.csv
+// format is <function name>, <lowest depth in bucket>, <recursive entries>
+static void printRecursion(const std::vector<registration*>& modules) {
+	std::ofstream results ("profile-recursion.csv", std::ofstream::out);
+	for (registration* entry : modules) {
+		const moduleInfo& mod = *entry->mod.load();
+		if (!mod.recursion) {
+			continue;
+		}
+		for (uint64_t col = 0; col < mod.numInternal; ++col) {
+			for (uint64_t bucket = 0; bucket < RECURSION_BUCKETS; ++bucket) {
+				uint64_t count = mod.recursion[col * RECURSION_BUCKETS + bucket];
+				if (count > 0) {
+					results << entry->library << mod.funcs[col] << ", "
+						<< (1ULL << bucket) << ", "
+						<< count << "\n";
+				}
+			}
+		}
+	}
+	results.close();
+}
+
+
+// call site locations keyed by (object, caller name, call site ordinal)
+typedef std::map<std::tuple<std::string, std::string, uint32_t>,
+	std::pair<std::string, uint32_t> > siteMap;
+
+
+// load the site map written by callgraph-profiler -site-map
+// each line is <object>\t<caller>\t<call site ordinal>\t<filename>\t<line #>
+static void loadSiteMap(const std::string& path, siteMap& sites)
+{
+	std::ifstream in(path);
+	std::string object, caller, filename, site, line;
+	while (std::getline(in, object, '\t') &&
+		std::getline(in, caller, '\t') &&
+		std::getline(in, site, '\t') &&
+		std::getline(in, filename, '\t') &&
+		std::getline(in, line))
+	{
+		sites[std::make_tuple(object, caller, (uint32_t) std::strtoul(site.c_str(), nullptr, 10))] =
+			std::make_pair(filename, (uint32_t) std::strtoul(line.c_str(), nullptr, 10));
+	}
+}
+
+
+// load every site map of a colon separated list, one per module
+static void loadSiteMaps(const char* paths, siteMap& sites)
+{
+	std::string list(paths);
+	for (size_t start = 0; start < list.size();) {
+		size_t end = std::min(list.find(':', start), list.size());
+		if (end > start) {
+			loadSiteMap(list.substr(start, end - start), sites);
+		}
+		start = end + 1;
+	}
+}
+
+
+}
+
+
+using namespace cgprofiler;
+
+
+extern "C" {
+
+
+// shows up as method `CaLlPrOfIlEr_print`
+void CGPROF(print)() {
+	flushCounts(nullptr);
+
+	// stream to output file: profile-results.csv
+	std::ofstream results ("profile-results.csv", std::ofstream::out);
+
+	// call sites without line info are symbolized lazily from the site maps
+	// listed by CALLPROFILER_SITE_MAP, loaded only if such a call site was hit
+	siteMap sites;
+	bool sitesLoaded = false;
+
+	// for all call sites of all modules record the info of each counted cell
+	// callers within shared libraries are prefixed by <library name>!
+	std::vector<registration*> modules = registeredModules();
+	// hardware event costs of each module's cells, if the runtime measured any
+	std::vector<const uint64_t*> costs;
+	bool withCosts = false;
+	for (registration* entry : modules) {
+		costs.push_back(cellCosts(entry->loaded));
+		withCosts |= nullptr != costs.back();
+	}
+	bool collapsedRecursion = false;
+	for (size_t m = 0; m < modules.size(); ++m) {
+		registration* entry = modules[m];
+		const moduleInfo& mod = *entry->mod.load();
+		collapsedRecursion |= nullptr != mod.recursion;
+		for (uint64_t row = 0; row < mod.numSites; ++row) {
+			auto& info = mod.sites[row];
+			uint64_t numCols = ANY_CALLEE == info.callee ? mod.numInternal : 1;
+			for (uint64_t i = 0; i < numCols; ++i) {
+				uint64_t cell = info.firstCell + i;
+				uint64_t count = mod.cells[cell];
+				if (0 == count) {
+					continue;
+				}
+				const char* callee = mod.funcs[ANY_CALLEE == info.callee ? i : info.callee];
+				const char* callmodule = info.callmodule;
+				uint32_t line = info.line;
+				if (0 == line) {
+					if (!sitesLoaded) {
+						if (const char* path = std::getenv("CALLPROFILER_SITE_MAP")) {
+							loadSiteMaps(path, sites);
+						}
+						sitesLoaded = true;
+					}
+					auto it = sites.find(std::make_tuple(entry->object,
+						std::string(info.caller), info.site));
+					if (it != sites.end()) {
+						callmodule = it->second.first.c_str();
+						line = it->second.second;
+					}
+				}
+				// format is <caller name>, <callsite filename>, <call site line #>, <callee name>, <frequency>
+				// unresolved call sites show their ordinal within the caller as #<ordinal>
+				results << entry->library << info.caller << ", "
+					<< callmodule << ", ";
+				if (line) {
+					results << line;
+				} else {
+					results << "#" << info.site;
+				}
+				results << ", "
+					<< callee << ", "
+					<< count;
+				// inclusive <cycles>, <instructions>, <L1D misses>, <LLC misses> of the edge
+				if (withCosts) {
+					for (unsigned event = 0; event < COST_EVENTS; ++event) {
+						results << ", " << (costs[m] ? costs[m][cell * COST_EVENTS + event] : 0);
+					}
+				}
+				results << "\n";
+			}
+		}
+	}
+	results.close();
+
+	if (collapsedRecursion) {
+		printRecursion(modules);
+	}
+
+	// full diagnostics go to the file named by CALLPROFILER_DIAGNOSTICS
+	// format is <shadow stack>, <frames now>, <most frames at once> for the
+	// thread writing the profile, then for every internal function
+	// <function name>, <entries>, <counted incoming edges>, <unattributed entries>
+	std::ofstream diagnostics;
+	if (const char* path = std::getenv("CALLPROFILER_DIAGNOSTICS")) {
+		diagnostics.open(path, std::ofstream::out);
+	}
+	if (diagnostics.is_open()) {
+		const shadowStack& stack = currentStack();
+		diagnostics << "<shadow stack>, " << stack.size() << ", "
+			<< stack.deepest << "\n";
+	}
+	if (!exactCounts()) {
+		return;
+	}
+	for (registration* entry : modules) {
+		checkInvariants(*entry->mod.load(), entry->library, entry->guarded,
+			diagnostics);
+	}
+}
+
+}
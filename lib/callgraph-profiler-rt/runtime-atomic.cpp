@@ -0,0 +1,49 @@
+
+#include "runtime.h"
+
+// multithreaded runtime variant: a shadow stack per thread and counters
+// shared by all threads, updated atomically
+
+namespace cgprofiler {
+
+
+static inline void atomicIncrement(uint64_t& counter) {
+	__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+}
+
+
+struct atomicCounters : uncostedFrames
+{
+	static shadowStack& stack() { return threadStack(); }
+
+	static void countCell(const moduleInfo* mod, uint64_t cell) {
+		atomicIncrement(mod->cells[cell]);
+	}
+
+	static void countEntry(const moduleInfo* mod, uint64_t col) {
+		atomicIncrement(mod->entries[col]);
+	}
+
+	static void countRecursion(const moduleInfo* mod, uint64_t bucket) {
+		atomicIncrement(mod->recursion[bucket]);
+	}
+
+	static void countUnattributed(const moduleInfo* mod, uint64_t col) {
+		atomicIncrement(mod->unattributed[col]);
+	}
+};
+
+
+void flushCounts(const moduleInfo*) {}
+
+
+bool exactCounts() { return true; }
+
+
+const uint64_t* cellCosts(const moduleInfo*) { return nullptr; }
+
+
+}
+
+
+CGPROF_DEFINE_HOOKS(cgprofiler::atomicCounters)
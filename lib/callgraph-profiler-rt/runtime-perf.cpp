@@ -0,0 +1,324 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "runtime.h"
+
+// multithreaded runtime variant attributing hardware events to edges: every
+// thread opens its own perf_event counters, reads them when an internal
+// function is entered and left, and adds the difference to the cell of the
+// edge that entered it. Counts are kept as in the atomic variant, and only
+// counts are kept when perf events are unavailable.
+
+namespace cgprofiler {
+
+
+static inline void atomicIncrement(uint64_t& counter) {
+	__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc(uint32_t counter) {
+	uint32_t low, high;
+	__asm__ volatile("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+	return (uint64_t) high << 32 | low;
+}
+#endif
+
+
+// one hardware event counted for the calling thread, read in user space
+// through the counter's mmap'd page where the kernel allows rdpmc
+struct eventCounter
+{
+	int fd = -1;
+	perf_event_mmap_page* page = nullptr;
+
+	bool open(uint32_t type, uint64_t config) {
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd < 0) {
+			return false;
+		}
+		void* mapped = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+		if (MAP_FAILED != mapped) {
+			page = static_cast<perf_event_mmap_page*>(mapped);
+		}
+		return true;
+	}
+
+	void close() {
+		if (page) {
+			munmap(page, sysconf(_SC_PAGESIZE));
+			page = nullptr;
+		}
+		if (fd >= 0) {
+			::close(fd);
+			fd = -1;
+		}
+	}
+
+	uint64_t value() const {
+		if (fd < 0) {
+			return 0;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		// the kernel's seqlock protocol for self monitoring
+		if (page && page->cap_user_rdpmc) {
+			uint32_t seq;
+			int64_t count;
+			do {
+				seq = page->lock;
+				__asm__ volatile("" ::: "memory");
+				uint32_t index = page->index;
+				if (!index) {
+					// not currently on a hardware counter
+					break;
+				}
+				count = page->offset;
+				unsigned width = page->pmc_width;
+				int64_t pmc = rdpmc(index - 1);
+				pmc <<= 64 - width;
+				pmc >>= 64 - width;
+				count += pmc;
+				__asm__ volatile("" ::: "memory");
+				if (page->lock == seq) {
+					return count;
+				}
+			} while (true);
+		}
+#endif
+		uint64_t count = 0;
+		if (sizeof(count) != read(fd, &count, sizeof(count))) {
+			return 0;
+		}
+		return count;
+	}
+};
+
+
+// event counts at the entry of a shadow stack frame
+struct frameStart
+{
+	const moduleInfo* mod;
+	uint64_t cell;
+	uint64_t start[COST_EVENTS];
+};
+
+
+// COST_EVENTS totals per cell of each registered module, folded from all
+// threads; never destroyed since modules are unregistered after this
+// library's static destructors have run
+static std::mutex& totalsLock() {
+	static std::mutex* lock = new std::mutex();
+	return *lock;
+}
+
+static std::map<const moduleInfo*, std::vector<uint64_t> >& totals() {
+	static auto* costs = new std::map<const moduleInfo*, std::vector<uint64_t> >();
+	return *costs;
+}
+
+// whether any thread could open the counters
+static std::atomic<bool> measured(false);
+
+
+struct threadCosts
+{
+	eventCounter counters[COST_EVENTS];
+	// counters could be opened for this thread
+	bool measuring = false;
+	// indexed by shadow stack depth - 1
+	std::vector<frameStart> starts;
+	std::map<const moduleInfo*, std::vector<uint64_t> > costs;
+	// costs of the module left last, frames mostly stay within one module
+	const moduleInfo* lastModule = nullptr;
+	std::vector<uint64_t>* lastCosts = nullptr;
+
+	threadCosts() {
+		measuring = counters[0].open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		if (!measuring) {
+			return;
+		}
+		counters[1].open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		// events the hardware doesn't provide read as 0
+		counters[2].open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+			| PERF_COUNT_HW_CACHE_OP_READ << 8
+			| PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		counters[3].open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+			| PERF_COUNT_HW_CACHE_OP_READ << 8
+			| PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		measured.store(true);
+	}
+
+	~threadCosts() {
+		for (eventCounter& counter : counters) {
+			counter.close();
+		}
+	}
+
+	void read(uint64_t* values) const {
+		for (unsigned event = 0; event < COST_EVENTS; ++event) {
+			values[event] = counters[event].value();
+		}
+	}
+
+	std::vector<uint64_t>& get(const moduleInfo* mod) {
+		if (lastModule != mod) {
+			std::vector<uint64_t>& table = costs[mod];
+			if (table.empty()) {
+				table.resize(mod->numCells * COST_EVENTS, 0);
+			}
+			lastModule = mod;
+			lastCosts = &table;
+		}
+		return *lastCosts;
+	}
+
+	// costs are dropped once folded, the module may be about to be unloaded
+	void flush() {
+		if (costs.empty()) {
+			return;
+		}
+		std::lock_guard<std::mutex> guard(totalsLock());
+		for (auto& moduleCosts : costs) {
+			std::vector<uint64_t>& total = totals()[moduleCosts.first];
+			total.resize(moduleCosts.second.size(), 0);
+			for (size_t i = 0; i < total.size(); ++i) {
+				total[i] += moduleCosts.second[i];
+			}
+		}
+		costs.clear();
+		lastModule = nullptr;
+		lastCosts = nullptr;
+	}
+};
+
+
+// allocated on first entry, module destructors and the profile may still
+// flush after this thread's thread_local objects are destroyed
+static thread_local threadCosts* costs = nullptr;
+
+
+struct costsOwner
+{
+	~costsOwner() {
+		if (costs) {
+			costs->flush();
+			delete costs;
+			costs = nullptr;
+		}
+	}
+};
+
+
+static thread_local costsOwner owner;
+
+
+static inline threadCosts& threadState() {
+	if (!costs) {
+		costs = new threadCosts();
+		// fold the costs and close the counters when the thread exits
+		(void) &owner;
+	}
+	return *costs;
+}
+
+
+struct perfCounters
+{
+	static shadowStack& stack() { return threadStack(); }
+
+	static void countCell(const moduleInfo* mod, uint64_t cell) {
+		atomicIncrement(mod->cells[cell]);
+	}
+
+	static void countEntry(const moduleInfo* mod, uint64_t col) {
+		atomicIncrement(mod->entries[col]);
+	}
+
+	static void countRecursion(const moduleInfo* mod, uint64_t bucket) {
+		atomicIncrement(mod->recursion[bucket]);
+	}
+
+	static void countUnattributed(const moduleInfo* mod, uint64_t col) {
+		atomicIncrement(mod->unattributed[col]);
+	}
+
+	static void pushed(uint64_t depth, const moduleInfo* mod, uint64_t cell) {
+		threadCosts& state = threadState();
+		if (!state.measuring) {
+			return;
+		}
+		if (state.starts.size() < depth) {
+			state.starts.resize(depth);
+		}
+		frameStart& frame = state.starts[depth - 1];
+		frame.mod = mod;
+		frame.cell = cell;
+		if (NO_CELL != cell) {
+			state.read(frame.start);
+		}
+	}
+
+	// costs are inclusive, a frame's costs include those of its callees
+	static void popped(uint64_t from, uint64_t to) {
+		if (!costs || !costs->measuring || from <= to) {
+			return;
+		}
+		threadCosts& state = *costs;
+		uint64_t now[COST_EVENTS];
+		state.read(now);
+		for (uint64_t depth = std::min<uint64_t>(from, state.starts.size()); depth > to; --depth) {
+			const frameStart& frame = state.starts[depth - 1];
+			if (NO_CELL == frame.cell) {
+				continue;
+			}
+			uint64_t* cell = &state.get(frame.mod)[frame.cell * COST_EVENTS];
+			for (unsigned event = 0; event < COST_EVENTS; ++event) {
+				cell[event] += now[event] - frame.start[event];
+			}
+		}
+	}
+};
+
+
+// costs of other threads still running are left out
+void flushCounts(const moduleInfo*) {
+	if (costs) {
+		costs->flush();
+	}
+}
+
+
+bool exactCounts() { return true; }
+
+
+const uint64_t* cellCosts(const moduleInfo* mod) {
+	if (!measured.load()) {
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> guard(totalsLock());
+	auto it = totals().find(mod);
+	return it == totals().end() ? nullptr : it->second.data();
+}
+
+
+}
+
+
+CGPROF_DEFINE_HOOKS(cgprofiler::perfCounters)
@@ -0,0 +1,127 @@
+
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+
+#include "runtime.h"
+
+// multithreaded sampling runtime variant: the shadow stack is kept exactly,
+// but only about every CALLPROFILER_SAMPLE_PERIOD-th count of each thread is
+// recorded, weighted by the period so that counts stay unbiased estimates
+
+namespace cgprofiler {
+
+
+// read on first use since instrumented static constructors may count
+// before this library's own are run
+static uint64_t samplePeriod() {
+	static const uint64_t period = [] {
+		const char* env = std::getenv("CALLPROFILER_SAMPLE_PERIOD");
+		uint64_t n = env ? std::strtoull(env, nullptr, 10) : 0;
+		return n ? n : 64;
+	}();
+	return period;
+}
+
+
+static thread_local uint64_t untilSample = 0;
+// 0 until the thread's first count
+static thread_local uint64_t sampleSeed = 0;
+
+
+// gaps between samples are drawn uniformly from [1, 2 * period - 1] so that
+// they don't alias with the fixed pattern of counts in loops
+static uint64_t nextGap(uint64_t period) {
+	sampleSeed ^= sampleSeed << 13;
+	sampleSeed ^= sampleSeed >> 7;
+	sampleSeed ^= sampleSeed << 17;
+	return 1 + sampleSeed % (2 * period - 1);
+}
+
+
+// threads seeded so far, ids and thread local storage of exited threads
+// are reused by new ones
+static std::atomic<uint64_t> seededThreads(0);
+
+
+// every thread draws its own gaps, seeded by mixing how many threads were
+// seeded before it with its id and the address of its thread local storage
+static void seedThread() {
+	uint64_t seed = std::hash<std::thread::id>()(std::this_thread::get_id())
+		^ reinterpret_cast<uintptr_t>(&untilSample);
+	seed += (seededThreads.fetch_add(1, std::memory_order_relaxed) + 1)
+		* 0x9e3779b97f4a7c15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+	seed ^= seed >> 31;
+	sampleSeed = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+
+// the first gap of a thread is the rest of a gap already under way: gap k
+// is drawn in proportion to the number of gaps of at least k, so the first
+// count is sampled once in period like any other
+static uint64_t firstGap(uint64_t period) {
+	uint64_t gap;
+	do {
+		gap = nextGap(period);
+	} while (gap + nextGap(period) > 2 * period);
+	return gap;
+}
+
+
+static inline void sample(uint64_t& counter) {
+	if (0 == untilSample) {
+		uint64_t period = samplePeriod();
+		if (0 == sampleSeed) {
+			seedThread();
+			// the gap-th count of the thread is its first sample
+			uint64_t gap = firstGap(period);
+			if (gap > 1) {
+				untilSample = gap - 2;
+				return;
+			}
+		}
+		untilSample = nextGap(period);
+		__atomic_fetch_add(&counter, period, __ATOMIC_RELAXED);
+	}
+	--untilSample;
+}
+
+
+struct sampledCounters : uncostedFrames
+{
+	static shadowStack& stack() { return threadStack(); }
+
+	static void countCell(const moduleInfo* mod, uint64_t cell) {
+		sample(mod->cells[cell]);
+	}
+
+	static void countEntry(const moduleInfo* mod, uint64_t col) {
+		sample(mod->entries[col]);
+	}
+
+	static void countRecursion(const moduleInfo* mod, uint64_t bucket) {
+		sample(mod->recursion[bucket]);
+	}
+
+	static void countUnattributed(const moduleInfo* mod, uint64_t col) {
+		sample(mod->unattributed[col]);
+	}
+};
+
+
+void flushCounts(const moduleInfo*) {}
+
+
+bool exactCounts() { return false; }
+
+
+const uint64_t* cellCosts(const moduleInfo*) { return nullptr; }
+
+
+}
+
+
+CGPROF_DEFINE_HOOKS(cgprofiler::sampledCounters)
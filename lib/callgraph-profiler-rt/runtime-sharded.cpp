@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "runtime.h"
+
+// multithreaded runtime variant: every thread counts into its own shard of
+// each module's tables. Every thread's shards are kept on one list, and the
+// shards of all threads are folded into the module tables when a module is
+// unloaded or the profile is written.
+
+namespace cgprofiler {
+
+
+// counters only written by the owning thread, read by any folding thread
+static inline void ownerIncrement(uint64_t& counter) {
+	__atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+}
+
+
+// counts of one module made by one thread, counters only grow and the
+// counts up to folded are already in the module tables
+struct shard
+{
+	const moduleInfo* mod;
+	// set once the module is unloaded, the descriptor's address may be reused
+	std::atomic<bool> dead;
+	std::vector<uint64_t> cells;
+	std::vector<uint64_t> entries;
+	std::vector<uint64_t> recursion;
+	std::vector<uint64_t> unattributed;
+	std::vector<uint64_t> folded;
+
+	shard(const moduleInfo* m)
+	: mod(m), dead(false), cells(m->numCells, 0), entries(m->numInternal, 0),
+	recursion(m->recursion ? m->numInternal * RECURSION_BUCKETS : 0, 0),
+	unattributed(m->numInternal, 0),
+	folded(cells.size() + entries.size() + recursion.size() + unattributed.size(), 0) {}
+};
+
+
+// add what counts gained since the last fold to counters, folded holds the
+// counts at the last fold and is advanced past them
+static uint64_t* foldCounters(const std::vector<uint64_t>& counts, uint64_t* folded,
+	uint64_t* counters) {
+	for (size_t i = 0; i < counts.size(); ++i) {
+		uint64_t now = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+		if (now != folded[i]) {
+			__atomic_fetch_add(&counters[i], now - folded[i], __ATOMIC_RELAXED);
+			folded[i] = now;
+		}
+	}
+	return folded + counts.size();
+}
+
+
+// shards of one thread, on the list of every thread's shards. A thread
+// that exits gives its shards up for the next thread to start.
+struct threadShards
+{
+	// owner creating shards and threads folding them take turns
+	std::atomic<bool> locked;
+	std::atomic<bool> owned;
+	std::vector<shard*> shards;
+	// shard of the module counted last, hooks mostly stay within one module,
+	// only used by the owner
+	shard* last = nullptr;
+	threadShards* next = nullptr;
+
+	threadShards() : locked(false), owned(true) {}
+
+	void lock() {
+		while (locked.exchange(true, std::memory_order_acquire)) {
+		}
+	}
+
+	void unlock() {
+		locked.store(false, std::memory_order_release);
+	}
+
+	shard& get(const moduleInfo* mod) {
+		if (last && last->mod == mod && !last->dead.load(std::memory_order_relaxed)) {
+			return *last;
+		}
+		lock();
+		// shards of unloaded modules are folded and only still held by last
+		size_t kept = 0;
+		for (shard* s : shards) {
+			if (s->dead.load()) {
+				delete s;
+			} else {
+				shards[kept++] = s;
+			}
+		}
+		shards.resize(kept);
+		auto it = std::find_if(shards.begin(), shards.end(),
+			[mod](const shard* s) { return s->mod == mod; });
+		if (it == shards.end()) {
+			shards.push_back(new shard(mod));
+			it = shards.end() - 1;
+		}
+		last = *it;
+		unlock();
+		return *last;
+	}
+
+	// fold the shards of every live module, and retire those of unloaded
+	void fold(const moduleInfo* unloaded) {
+		lock();
+		for (shard* s : shards) {
+			if (s->dead.load()) {
+				continue;
+			}
+			moduleInfo* tables = liveTables(s->mod);
+			uint64_t* folded = s->folded.data();
+			folded = foldCounters(s->cells, folded, tables->cells);
+			folded = foldCounters(s->entries, folded, tables->entries);
+			if (tables->recursion) {
+				folded = foldCounters(s->recursion, folded, tables->recursion);
+			}
+			foldCounters(s->unattributed, folded, tables->unattributed);
+			if (s->mod == unloaded) {
+				s->dead.store(true);
+			}
+		}
+		unlock();
+	}
+};
+
+
+// lock-free list of every thread's shards, newest first, never shrinks
+static std::atomic<threadShards*> allShards(nullptr);
+
+
+// shards given up by an exited thread, or new ones
+static threadShards* acquireShards() {
+	for (threadShards* node = allShards.load(); node; node = node->next) {
+		bool owned = false;
+		if (!node->owned.load() && node->owned.compare_exchange_strong(owned, true)) {
+			node->last = nullptr;
+			return node;
+		}
+	}
+	auto* node = new threadShards();
+	node->next = allShards.load();
+	while (!allShards.compare_exchange_weak(node->next, node)) {
+	}
+	return node;
+}
+
+
+// acquired on first count, module destructors and the profile may still
+// count after this thread's thread_local objects are destroyed
+static thread_local threadShards* counts = nullptr;
+
+
+struct shardsOwner
+{
+	~shardsOwner() {
+		if (counts) {
+			counts->fold(nullptr);
+			counts->owned.store(false);
+			counts = nullptr;
+		}
+	}
+};
+
+
+static thread_local shardsOwner owner;
+
+
+static inline threadShards& threadCounts() {
+	if (!counts) {
+		counts = acquireShards();
+		// give the shards up when the thread exits
+		(void) &owner;
+	}
+	return *counts;
+}
+
+
+struct shardedCounters : uncostedFrames
+{
+	static shadowStack& stack() { return threadStack(); }
+
+	static void countCell(const moduleInfo* mod, uint64_t cell) {
+		ownerIncrement(threadCounts().get(mod).cells[cell]);
+	}
+
+	static void countEntry(const moduleInfo* mod, uint64_t col) {
+		ownerIncrement(threadCounts().get(mod).entries[col]);
+	}
+
+	static void countRecursion(const moduleInfo* mod, uint64_t bucket) {
+		ownerIncrement(threadCounts().get(mod).recursion[bucket]);
+	}
+
+	static void countUnattributed(const moduleInfo* mod, uint64_t col) {
+		ownerIncrement(threadCounts().get(mod).unattributed[col]);
+	}
+};
+
+
+void flushCounts(const moduleInfo* unloaded) {
+	for (threadShards* node = allShards.load(); node; node = node->next) {
+		node->fold(unloaded);
+	}
+}
+
+
+bool exactCounts() { return true; }
+
+
+const uint64_t* cellCosts(const moduleInfo*) { return nullptr; }
+
+
+}
+
+
+CGPROF_DEFINE_HOOKS(cgprofiler::shardedCounters)
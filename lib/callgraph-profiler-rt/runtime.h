@@ -0,0 +1,348 @@
+
+#ifndef CALLGRAPH_PROFILER_RUNTIME_H
+#define CALLGRAPH_PROFILER_RUNTIME_H
+
+#include <cstdint>
+#include <cstdlib>
+
+
+// This macro allows us to prefix strings so that they are less likely to
+// conflict with existing symbol names in the examined programs.
+// e.g. CGPROF(entry) yields CaLlPrOfIlEr_entry
+#define CGPROF(X) CaLlPrOfIlEr_ ## X
+
+namespace cgprofiler {
+
+
+// callee column of function pointer call sites, the row holds a cell
+// for every internal function ordered by id
+static const uint64_t ANY_CALLEE = ~0ULL;
+// no call site row is waiting for a function entry
+static const uint64_t NO_SITE = ~0ULL;
+// the next function entry continues a recursive cycle in the caller's frame
+static const uint64_t RECURSE_SITE = NO_SITE - 1;
+// recursion depth histogram buckets per function, bucket b counts
+// recursive entries reaching depths [2^b, 2^(b+1))
+static const uint64_t RECURSION_BUCKETS = 32;
+// no cell of the edge matrix counted the entry of a frame
+static const uint64_t NO_CELL = ~0ULL;
+// hardware events measured per cell by runtimes attributing costs to edges:
+// cycles, instructions, L1D read misses and LLC read misses
+static const unsigned COST_EVENTS = 4;
+
+
+// call site row of the edge matrix
+struct siteInfo
+{
+	char* caller;
+	char* callmodule;
+	uint32_t line;
+	uint32_t site;
+	uint64_t callee;
+	uint64_t firstCell;
+};
+
+
+// descriptor of one instrumented module (executable or shared library)
+// passed to every hook and registered from the module's constructor
+// columns are internal functions ordered by id followed by external callees
+struct moduleInfo
+{
+	siteInfo* sites;
+	uint64_t numSites;
+	char** funcs;
+	uint64_t numFuncs;
+	uint64_t numInternal;
+	uint64_t* cells;
+	uint64_t numCells;
+	uint64_t* entries;
+	// RECURSION_BUCKETS per internal function, null unless recursion is collapsed
+	uint64_t* recursion;
+	// per internal function, call sites of the function are only profiled
+	// while its guard is set, null unless hooks are guarded
+	uint8_t* guards;
+	// per internal function, entries not counted by any cell: program start,
+	// callbacks from external code and calls from other modules
+	uint64_t* unattributed;
+	// per internal function, set if it is local to the module and its
+	// address is never taken, so only this module's call sites enter it
+	uint8_t* directOnly;
+};
+
+
+// shadow stack frame of an active internal function
+struct inFunc
+{
+	uint64_t col;
+	// call site row waiting for the next internal function entry
+	const moduleInfo* siteModule;
+	uint64_t site;
+	// nested activations of a collapsed recursive cycle sharing this frame
+	uint64_t recursion;
+	inFunc(uint64_t c) : col(c), siteModule(nullptr), site(NO_SITE), recursion(0) {}
+};
+
+
+// shadow stack of one thread. It has no destructor, so it is never
+// destroyed: instrumented destructors may still enter frames after this
+// library's globals and the thread's thread_local objects are destroyed.
+struct shadowStack
+{
+	inFunc* frames = nullptr;
+	uint64_t depth = 0;
+	uint64_t capacity = 0;
+	// most frames held at once, stays bounded when frames skipped by
+	// exceptions or longjmp are dropped
+	uint64_t deepest = 0;
+
+	bool empty() const { return 0 == depth; }
+	uint64_t size() const { return depth; }
+	inFunc& back() { return frames[depth - 1]; }
+
+	void push_back(const inFunc& frame) {
+		if (depth == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			frames = static_cast<inFunc*>(std::realloc(frames, capacity * sizeof(inFunc)));
+			if (!frames) {
+				std::abort();
+			}
+		}
+		frames[depth++] = frame;
+		if (depth > deepest) {
+			deepest = depth;
+		}
+	}
+
+	// frames are only ever dropped from the top
+	void truncate(uint64_t to) {
+		depth = to;
+	}
+
+	// free the frames of a thread that exits
+	void release() {
+		std::free(frames);
+		frames = nullptr;
+		depth = 0;
+		capacity = 0;
+	}
+};
+
+
+struct stackReleaser
+{
+	shadowStack& stack;
+	stackReleaser(shadowStack& s) : stack(s) {}
+	~stackReleaser() { stack.release(); }
+};
+
+
+// shadow stack of the calling thread for multithreaded variants, its frames
+// are released when the thread exits
+static inline shadowStack& threadStack() {
+	static thread_local shadowStack stack;
+	static thread_local bool releasing = false;
+	if (!releasing) {
+		releasing = true;
+		static thread_local stackReleaser releaser(stack);
+	}
+	return stack;
+}
+
+
+// watermarks hold the shadow stack depth in the upper half and the
+// recursion depth within the top frame in the lower half
+static inline uint64_t watermark(uint64_t depth, uint64_t recursion) {
+	return depth << 32 | (recursion & 0xffffffff);
+}
+
+
+// counters of mod as they currently live, the module's own tables while it
+// is loaded and their snapshot once it has been unloaded (see registry.cpp)
+moduleInfo* liveTables(const moduleInfo* mod);
+
+
+// implemented by each runtime variant
+// fold pending counts of every thread into the module tables before a
+// module is unloaded (unloaded) or the profile is written (null), hardware
+// event costs only of the calling thread and of threads that exited
+void flushCounts(const moduleInfo* unloaded);
+// shadow stack of the calling thread, defined by CGPROF_DEFINE_HOOKS
+const shadowStack& currentStack();
+// whether entry and edge counts are exact enough to check against each other
+bool exactCounts();
+// COST_EVENTS totals per cell of the module registered as mod, or null if
+// the variant doesn't measure costs or could not open the counters
+const uint64_t* cellCosts(const moduleInfo* mod);
+
+
+// frame hooks of policies not measuring the cost of frames
+struct uncostedFrames
+{
+	static void pushed(uint64_t, const moduleInfo*, uint64_t) {}
+	static void popped(uint64_t, uint64_t) {}
+};
+
+
+// hooks shared by every runtime variant, specialized by a policy providing
+//   static shadowStack& stack();  shadow stack of the calling thread
+//   static void countCell(const moduleInfo*, uint64_t cell);
+//   static void countEntry(const moduleInfo*, uint64_t col);
+//   static void countRecursion(const moduleInfo*, uint64_t bucket);
+//   static void countUnattributed(const moduleInfo*, uint64_t col);
+//   static void pushed(uint64_t depth, const moduleInfo*, uint64_t cell);
+//                                         frame depth entered by cell
+//   static void popped(uint64_t from, uint64_t to);
+//                                         frames (to, from] are left
+// e.g. by deriving from uncostedFrames
+template <typename Policy>
+struct engine
+{
+	// the single update path of the edge matrix, entries only count the edge
+	// if the row has a cell for column col
+	// col is an internal column and rows of call sites are built by the pass,
+	// so neither needs bounds checks
+	static inline uint64_t record(const moduleInfo* mod, uint64_t row, uint64_t col) {
+		const siteInfo& info = mod->sites[row];
+		uint64_t cell = NO_CELL;
+		if (ANY_CALLEE == info.callee) {
+			cell = info.firstCell + col;
+		} else if (info.callee == col) {
+			cell = info.firstCell;
+		}
+		if (NO_CELL != cell) {
+			Policy::countCell(mod, cell);
+		}
+		return cell;
+	}
+
+	static inline void popTo(shadowStack& frames, uint64_t depth) {
+		Policy::popped(frames.size(), depth);
+		frames.truncate(depth);
+	}
+
+	static inline void site(const moduleInfo* mod, uint64_t row) {
+		shadowStack& frames = Policy::stack();
+		if (frames.empty()) {
+			// guarded callers entered before profiling was enabled have no
+			// frame, a bottom frame stands in for all of them
+			frames.push_back(inFunc(ANY_CALLEE));
+		}
+		frames.back().siteModule = mod;
+		frames.back().site = row;
+	}
+
+	// the pass only emits this for rows holding the single cell of callee
+	static inline void edge(const moduleInfo* mod, uint64_t row) {
+		Policy::countCell(mod, mod->sites[row].firstCell);
+		// internal functions called back from external code are not this edge
+		site(mod, row);
+	}
+
+	static inline void recurse(const moduleInfo* mod, uint64_t row) {
+		Policy::countCell(mod, mod->sites[row].firstCell);
+		site(mod, RECURSE_SITE);
+	}
+
+	static inline uint64_t enter(const moduleInfo* mod, uint64_t col) {
+		Policy::countEntry(mod, col);
+		shadowStack& frames = Policy::stack();
+		uint64_t cell = NO_CELL;
+		if (!frames.empty()) {
+			inFunc& caller = frames.back();
+			uint64_t row = caller.site;
+			caller.site = NO_SITE;
+			// a recursive call may bind to a function of the same name in
+			// another module, which has no cycle and maybe no histograms
+			if (RECURSE_SITE == row && caller.siteModule == mod && mod->recursion) {
+				// the edge was counted at the call site, stay in the caller's frame
+				++caller.recursion;
+				uint64_t bucket = 0;
+				while (bucket + 1 < RECURSION_BUCKETS && caller.recursion >> (bucket + 1)) {
+					++bucket;
+				}
+				Policy::countRecursion(mod, col * RECURSION_BUCKETS + bucket);
+				return watermark(frames.size(), caller.recursion);
+			}
+			// calls across modules have no cell in the calling module's row
+			if (NO_SITE != row && RECURSE_SITE != row && caller.siteModule == mod) {
+				cell = record(mod, row, col);
+			}
+		}
+		if (NO_CELL == cell) {
+			Policy::countUnattributed(mod, col);
+		}
+		frames.push_back(inFunc(col));
+		Policy::pushed(frames.size(), mod, cell);
+		return watermark(frames.size(), 0);
+	}
+
+	static inline void leave(uint64_t mark) {
+		shadowStack& frames = Policy::stack();
+		uint64_t depth = mark >> 32;
+		uint64_t recursion = mark & 0xffffffff;
+		if (frames.size() < depth) {
+			return;
+		}
+		if (recursion) {
+			popTo(frames, depth);
+			frames.back().recursion = recursion - 1;
+		} else {
+			popTo(frames, depth - 1);
+		}
+	}
+
+	// truncating to the watermark drops frames skipped by exceptions or longjmp
+	static inline void resync(uint64_t mark) {
+		shadowStack& frames = Policy::stack();
+		uint64_t depth = mark >> 32;
+		if (frames.size() >= depth) {
+			popTo(frames, depth);
+			frames.back().recursion = mark & 0xffffffff;
+		}
+	}
+};
+
+
+}
+
+
+extern "C" {
+// set while any guarded function is enabled, see registry.cpp
+extern uint8_t CGPROF(active);
+// enable or disable every guarded function
+void CGPROF(enable)(int on);
+// enable or disable the guarded functions named name
+uint64_t CGPROF(enableFunction)(const char* name, int on);
+}
+
+
+// define the hooks called by instrumented code for one runtime variant
+#define CGPROF_DEFINE_HOOKS(POLICY) \
+	namespace cgprofiler { \
+	const shadowStack& currentStack() { \
+		return POLICY::stack(); \
+	} \
+	} \
+	extern "C" { \
+	void CGPROF(site)(const cgprofiler::moduleInfo* mod, uint64_t row) { \
+		cgprofiler::engine<POLICY>::site(mod, row); \
+	} \
+	void CGPROF(edge)(const cgprofiler::moduleInfo* mod, uint64_t row) { \
+		cgprofiler::engine<POLICY>::edge(mod, row); \
+	} \
+	void CGPROF(recurse)(const cgprofiler::moduleInfo* mod, uint64_t row) { \
+		cgprofiler::engine<POLICY>::recurse(mod, row); \
+	} \
+	uint64_t CGPROF(enter)(const cgprofiler::moduleInfo* mod, uint64_t col) { \
+		return cgprofiler::engine<POLICY>::enter(mod, col); \
+	} \
+	void CGPROF(leave)(uint64_t mark) { \
+		cgprofiler::engine<POLICY>::leave(mark); \
+	} \
+	void CGPROF(resync)(uint64_t mark) { \
+		cgprofiler::engine<POLICY>::resync(mark); \
+	} \
+	}
+
+
+#endif
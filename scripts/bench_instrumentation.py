@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+
+# Time the instrumentation pass of one or more callgraph-profiler binaries on
+# the same generated module, e.g. builds from before and after a change:
+#
+#   bench_instrumentation.py --clang clang-3.9 before/callgraph-profiler \
+#       after/callgraph-profiler
+#
+# The module has many functions with direct, external and function pointer
+# calls on distinct lines. The pass time comes from -time-passes, and the
+# best of all repeats is reported with the wall time of the whole tool.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# names of the pass in -time-passes reports, builds without getPassName()
+# show the legacy pass manager's placeholder
+PASS_NAMES = ('Call graph profiling instrumentation',
+              'Unnamed pass: implement Pass::getPassName()')
+
+# <time> (<percent>%) columns of a timer report line, the last is wall time
+TIMER_COLUMN = re.compile(r'(\d+\.\d+)\s+\(\s*\d+\.\d+%\)')
+
+
+def generate_module(functions, calls):
+    lines = ['#include <stdlib.h>', '',
+             'typedef int (*handler)(int);', '']
+    for f in range(functions):
+        lines.append('int f{}(int x);'.format(f))
+    lines.append('')
+    lines.append('static handler handlers[] = {f0, f1, f2, f3};')
+    lines.append('')
+    for f in range(functions):
+        lines.append('int')
+        lines.append('f{}(int x) {{'.format(f))
+        lines.append('  if (x <= 0) {')
+        lines.append('    return 0;')
+        lines.append('  }')
+        lines.append('  int sum = 0;')
+        for c in range(calls):
+            lines.append('  sum += f{}(x - 1);'.format((f + c + 1) % functions))
+        lines.append('  sum += abs(x);')
+        lines.append('  sum += handlers[x % 4](x - 1);')
+        lines.append('  return sum;')
+        lines.append('}')
+        lines.append('')
+    lines.append('int')
+    lines.append('main(int argc, char **argv) {')
+    lines.append('  return f0(argc - 1);')
+    lines.append('}')
+    return '\n'.join(lines) + '\n'
+
+
+def pass_seconds(report):
+    for line in report.splitlines():
+        if any(line.rstrip().endswith(name) for name in PASS_NAMES):
+            columns = TIMER_COLUMN.findall(line)
+            if columns:
+                return float(columns[-1])
+    return None
+
+
+def time_profiler(profiler, bitcode, output, repeats):
+    best_pass = None
+    best_wall = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        run = subprocess.run([profiler, bitcode, '-o', output, '-time-passes'],
+                             stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                             universal_newlines=True)
+        wall = time.perf_counter() - start
+        if run.returncode != 0:
+            sys.exit('error: ' + profiler + ' failed:\n' + run.stderr)
+        seconds = pass_seconds(run.stderr)
+        if seconds is None:
+            sys.exit('error: no instrumentation pass timing from ' + profiler)
+        best_pass = seconds if best_pass is None else min(best_pass, seconds)
+        best_wall = wall if best_wall is None else min(best_wall, wall)
+    return (best_pass, best_wall)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Time the instrumentation pass on a generated module.')
+    parser.add_argument('profilers', nargs='+',
+                        help='callgraph-profiler binaries to compare')
+    parser.add_argument('--clang', default='clang')
+    parser.add_argument('--functions', type=int, default=5000)
+    parser.add_argument('--calls', type=int, default=20,
+                        help='direct calls per function')
+    parser.add_argument('--repeats', type=int, default=5)
+    args = parser.parse_args()
+    if args.functions < 4:
+        parser.error('--functions must be at least 4')
+
+    with tempfile.TemporaryDirectory() as work:
+        source = os.path.join(work, 'bench.c')
+        bitcode = os.path.join(work, 'bench.bc')
+        with open(source, 'w') as out:
+            out.write(generate_module(args.functions, args.calls))
+        subprocess.check_call([args.clang, '-g', '-c', '-emit-llvm', source,
+                               '-o', bitcode])
+
+        print('{} functions, {} call sites, best of {}'.format(
+            args.functions, args.functions * (args.calls + 2) + 1, args.repeats))
+        print('{:>10} {:>10}  {}'.format('pass (s)', 'tool (s)', 'profiler'))
+        for profiler in args.profilers:
+            (seconds, wall) = time_profiler(profiler, bitcode,
+                                            os.path.join(work, 'bench'),
+                                            args.repeats)
+            print('{:10.4f} {:10.4f}  {}'.format(seconds, wall, profiler))
+
+
+if __name__ == '__main__':
+    main()
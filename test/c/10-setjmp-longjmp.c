@@ -0,0 +1,26 @@
+#include <setjmp.h>
+
+static jmp_buf env;
+
+void
+jumper(int i) {
+  longjmp(env, i);
+}
+
+void
+middle(int i) {
+  jumper(i);
+}
+
+void
+leaf(void) {}
+
+int
+main(int argc, char **argv) {
+  int i = setjmp(env);
+  if (i < argc) {
+    middle(i + 1);
+  }
+  leaf();
+  return 0;
+}
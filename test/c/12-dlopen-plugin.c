@@ -0,0 +1,23 @@
+#include <dlfcn.h>
+
+void
+helper(int i) {}
+
+void
+run(int i) {
+  helper(i);
+}
+
+int
+main(int argc, char **argv) {
+  for (int i = 0; i < 2; ++i) {
+    void *plugin = dlopen("./libplugin.so", RTLD_NOW);
+    if (plugin) {
+      void (*pluginRun)(int) = (void (*)(int))dlsym(plugin, "run");
+      pluginRun(i);
+      dlclose(plugin);
+    }
+  }
+  run(argc);
+  return 0;
+}
@@ -0,0 +1,27 @@
+extern "C" {
+
+void
+thrower(int i) {
+  if (i > 0) {
+    throw i;
+  }
+}
+
+void
+middle(int i) {
+  thrower(i);
+}
+
+void
+leaf() {}
+
+int
+main(int argc, char **argv) {
+  for (int i = 0; i < argc; ++i) {
+    try { middle(i); } catch (int) {}
+    leaf();
+  }
+  return 0;
+}
+
+}
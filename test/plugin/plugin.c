@@ -0,0 +1,8 @@
+void
+helper(int i) {}
+
+void
+run(int i) {
+  helper(i);
+  helper(i + 1);
+}
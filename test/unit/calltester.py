@@ -9,10 +9,17 @@ def csvRead(fname):
         for line in f:
             elems = line.split(',')
             if (5 == len(elems)):
+                # call sites without line info show their ordinal as #<ordinal>
+                # (is ordinal, number) keeps lines and ordinals sortable
+                lino = elems[2].strip(' ')
+                if lino.startswith('#'):
+                    lino = (True, int(lino[1:]))
+                else:
+                    lino = (False, int(lino))
                 elems = (
                     elems[0].strip(' '),
                     elems[1].strip(' '),
-                    int(elems[2]),
+                    lino,
                     elems[3].strip(' '),
                     int(elems[4]))
                 lines.append(elems)
@@ -37,17 +44,42 @@ def csvEquals (fname1, fname2):
             count == count2
         if (not correct):
             allCorrect = False
+    if (len(dic1) != len(dic2)):
+        allCorrect = False
     if (False == allCorrect):
         print(dic1)
         print(dic2)
     return allCorrect
 
+def linesRead(fname):
+    with open(fname, 'r') as f:
+        lines = []
+        for line in f:
+            if line.strip():
+                lines.append(tuple(elem.strip(' \n') for elem in line.split(',')))
+        lines.sort()
+        return lines
+
+# other profile files are compared line by line in any order
+def linesEqual (fname1, fname2):
+    lines1 = linesRead(fname1)
+    lines2 = linesRead(fname2)
+    if (lines1 != lines2):
+        print(lines1)
+        print(lines2)
+        return False
+    return True
+
 arg = sys.argv
 uname = arg[1]
 testfile = arg[2]
+# clang and callgraph-profiler to rebuild tests with other flags
+clang = arg[3] if len(arg) > 3 else None
+profiler = arg[4] if len(arg) > 4 else None
 
 testname = os.path.basename(testfile)
-testpath = testfile.split(testname)[0]+'../expectout'
+testdir = testfile.split(testname)[0]
+testpath = testdir+'../expectout'
 
 # map testfile name to arguments to call
 targ = {
@@ -65,16 +97,160 @@ targ = {
     '09-internal-recursion.c': [
         ('2 3', 'expect09argc3'),
         ('2 3 4 5 6 7 8 9 10', 'expect09argc10')
+    ],
+    '10-setjmp-longjmp.c': [('2 3', 'expect10')],
+    '11-exception-unwinding.cpp': [('2 3', 'expect11')],
+    '12-dlopen-plugin.c': [('', 'expect12')]
+}
+# instrumented shared libraries a test loads, built from test/plugin before
+# the test runs
+# (source relative to the test, tool flags, library)
+tplugins = {
+    '12-dlopen-plugin.c': [
+        ('../plugin/plugin.c', '-shared -site-map=plugin.sites', 'libplugin.so')
+    ]
+}
+# rebuild a test with other clang and callgraph-profiler flags, run it with
+# extra environment variables and compare each file the run writes with its
+# expected file
+# (clang flags, tool flags, arguments, environment, [(written file, expected file)])
+tvariants = {
+    '03-internal-call-in-loop.c': [
+        ('-gline-tables-only', '', '', {},
+            [('profile-results.csv', 'expect03')])
+    ],
+    '08-function-pointer-multiple-internal-targets.c': [
+        ('', '', '', {},
+            [('profile-results.csv', 'expect08nodebug')]),
+        ('-g', '-site-map=calls.sites', '', {'CALLPROFILER_SITE_MAP': 'calls.sites'},
+            [('profile-results.csv', 'expect08')]),
+        ('-g', '', '', {'CALLPROFILER_DIAGNOSTICS': 'profile-diagnostics.csv'},
+            [('profile-results.csv', 'expect08'),
+                ('profile-diagnostics.csv', 'diag08')]),
+        # guarded hooks profile all functions, only dispatcher's call sites,
+        # or nothing
+        ('-g', '-guarded', '', {'CALLPROFILER_ENABLE': '1'},
+            [('profile-results.csv', 'expect08')]),
+        ('-g', '-guarded', '', {'CALLPROFILER_ENABLE': 'dispatcher'},
+            [('profile-results.csv', 'expect08dispatcher')]),
+        ('-g', '-guarded', '', {},
+            [('profile-results.csv', 'expectnone')])
+    ],
+    # collapsed recursion keeps edge counts and writes depth histograms
+    '09-internal-recursion.c': [
+        ('-g', '-collapse-recursion', '2 3', {},
+            [('profile-results.csv', 'expect09argc3'),
+                ('profile-recursion.csv', 'recursion09argc3')]),
+        ('-g', '-collapse-recursion', '2 3 4 5 6 7 8 9 10', {},
+            [('profile-results.csv', 'expect09argc10'),
+                ('profile-recursion.csv', 'recursion09argc10')])
+    ],
+    # frames skipped by longjmp and exceptions are dropped, so the shadow
+    # stack never holds more frames than the deepest call
+    '10-setjmp-longjmp.c': [
+        ('-g', '', '2 3', {'CALLPROFILER_DIAGNOSTICS': 'profile-diagnostics.csv'},
+            [('profile-results.csv', 'expect10'),
+                ('profile-diagnostics.csv', 'diag10')]),
+        ('-g', '-guarded', '2 3', {'CALLPROFILER_ENABLE': '1'},
+            [('profile-results.csv', 'expect10')]),
+        ('-g', '-guarded', '2 3', {},
+            [('profile-results.csv', 'expectnone')])
+    ],
+    '11-exception-unwinding.cpp': [
+        ('-g', '', '2 3', {'CALLPROFILER_DIAGNOSTICS': 'profile-diagnostics.csv'},
+            [('profile-results.csv', 'expect11'),
+                ('profile-diagnostics.csv', 'diag11')]),
+        ('-g', '-guarded', '2 3', {'CALLPROFILER_ENABLE': '1'},
+            [('profile-results.csv', 'expect11')]),
+        ('-g', '-guarded', '2 3', {},
+            [('profile-results.csv', 'expectnone')])
+    ],
+    '12-dlopen-plugin.c': [
+        ('-g', '-site-map=calls.sites', '',
+            {'CALLPROFILER_SITE_MAP': 'calls.sites:plugin.sites'},
+            [('profile-results.csv', 'expect12mapped')])
     ]
 }
+
+# every runtime variant gives the regular profile, sampling every count
+# with a period of 1
+truntimes = [
+    ('-runtime=atomic', {}),
+    ('-runtime=sharded', {}),
+    ('-runtime=sampling', {'CALLPROFILER_SAMPLE_PERIOD': '1'})
+]
+for (tname, ar, res) in [
+        ('08-function-pointer-multiple-internal-targets.c', '', 'expect08'),
+        ('09-internal-recursion.c', '2 3', 'expect09argc3'),
+        ('11-exception-unwinding.cpp', '2 3', 'expect11')]:
+    for (tflags, env) in truntimes:
+        tvariants.setdefault(tname, []).append(
+            ('-g', tflags, ar, env, [('profile-results.csv', res)]))
+
+failed = False
 trash = open('temphistory', 'w')
+
+def runAndCompare(ar, env, outputs):
+    global failed
+    callargs = ['./'+uname]
+    if len(ar):
+        callargs = callargs + ar.split(' ')
+    runenv = dict(os.environ)
+    runenv.update(env)
+    # files left by an earlier run must not stand in for missing ones
+    for (written, res) in outputs:
+        if os.path.isfile(written):
+            os.remove(written)
+    subprocess.call(callargs, stdout=trash, env=runenv)
+    for (written, res) in outputs:
+        if not os.path.isfile(written):
+            print('Missing ' + written + ' for ' + res)
+            failed = True
+            continue
+        if not os.path.isdir(res):
+            os.makedirs(res)
+        os.rename(written, res+'/'+written)
+        compare = csvEquals if 'profile-results.csv' == written else linesEqual
+        if not compare('./'+res+'/'+written, testpath+'/'+res+'.csv'):
+            print('Mismatch in ' + res)
+            failed = True
+
+if clang and profiler:
+    for (source, tflags, library) in tplugins.get(testname, []):
+        subprocess.call([clang, '-g', '-c', '-emit-llvm',
+            testdir + source, '-o', 'plugin.bc'])
+        subprocess.call([profiler, 'plugin.bc', '-o', library] + tflags.split(),
+            stdout=trash)
+        if not os.path.isfile(library):
+            print('Unable to build ' + library + ' for ' + testname)
+            failed = True
+
 if (os.path.isfile(uname)):
     for (ar, res) in targ[testname]:
-        callargs = ['./'+uname]
-        if len(ar):
-            callargs = callargs + ar.split(' ')
-        subprocess.Popen(callargs, stdout=trash)
-        subprocess.Popen(['mv', 'profile-results.csv', res+'/profile-results.csv'])
-        csvEquals('./'+res+'/profile-results.csv', testpath+'/'+res+'.csv')
+        runAndCompare(ar, {}, [('profile-results.csv', res)])
 else:
     print('error: '+testfile+' compilation failed')
+    failed = True
+
+if clang and profiler:
+    for (cflags, tflags, ar, env, outputs) in tvariants.get(testname, []):
+        if os.path.isfile(uname):
+            os.remove(uname)
+        subprocess.call([clang] + cflags.split() +
+            ['-c', '-emit-llvm', testfile, '-o', 'calls.bc'])
+        subprocess.call([profiler, 'calls.bc', '-o', uname] + tflags.split(),
+            stdout=trash)
+        if (os.path.isfile(uname)):
+            runAndCompare(ar, env, outputs)
+        else:
+            print('Unable to build ' + testname + ' with ' + cflags + ' ' + tflags)
+            failed = True
+    for (source, tflags, library) in tplugins.get(testname, []):
+        for temp in [library, library + '.o', library + '.callcounter.bc']:
+            if os.path.isfile(temp):
+                os.remove(temp)
+    for temp in ['calls.sites', 'plugin.bc', 'plugin.sites']:
+        if os.path.isfile(temp):
+            os.remove(temp)
+
+sys.exit(1 if failed else 0)
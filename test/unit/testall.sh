@@ -3,13 +3,14 @@
 clang_path=${1-clang}
 bin_path=${2-../../build/bin/callgraph-profiler}
 test_path=${3-../c}
+cpp_test_path=${4-../cpp}
 
-for testfile in $test_path/*.c; do
+for testfile in $test_path/*.c $cpp_test_path/*.cpp; do
     echo "Verifying test case $testfile"
     bin_name=calls
     $clang_path -g -c -emit-llvm $testfile -o calls.bc
     $bin_path calls.bc -o $bin_name > temphistory
-    python calltester.py $bin_name $testfile
+    python calltester.py $bin_name $testfile $clang_path $bin_path
     rm $bin_name
     rm $bin_name.o
     rm $bin_name.callcounter.bc
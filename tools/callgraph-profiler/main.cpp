@@ -8,6 +8,7 @@
 #include "llvm/CodeGen/LinkAllAsmWriterComponents.h"
 #include "llvm/CodeGen/LinkAllCodegenComponents.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -35,12 +36,16 @@
 #include "llvm/Target/TargetSubtargetInfo.h"
 #include "llvm/Transforms/Scalar.h"
 
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include "ProfilingInstrumentationPass.h"
 
 #include "config.h"
+#include "server.h"
 
 
 using namespace llvm;
@@ -58,14 +63,12 @@ static cl::opt<string> inPath{cl::Positional,
                               cl::desc{"<Module to analyze>"},
                               cl::value_desc{"bitcode filename"},
                               cl::init(""),
-                              cl::Required,
                               cl::cat{callProfilerCategory}};
 
 static cl::opt<string> outFile{"o",
                                cl::desc{"Filename of the instrumented program"},
                                cl::value_desc{"filename"},
                                cl::init(""),
-                               cl::Required,
                                cl::cat{callProfilerCategory}};
 
 static cl::opt<char> optLevel{
@@ -88,43 +91,186 @@ static cl::list<string> libraries{"l",
                                   cl::value_desc{"library prefix"},
                                   cl::cat{callProfilerCategory}};
 
+static cl::opt<string> siteMapFile{
+    "site-map",
+    cl::desc{"Keep call site line info out of the instrumented program and "
+             "write it to a separate file, symbolized by the runtime when "
+             "the colon separated list CALLPROFILER_SITE_MAP names the file"},
+    cl::value_desc{"filename"},
+    cl::init(""),
+    cl::cat{callProfilerCategory}};
 
-static void
-compile(Module& m, StringRef outputPath) {
-  string err;
+static cl::opt<bool> collapseRecursion{
+    "collapse-recursion",
+    cl::desc{"Count calls within recursive cycles of the static call graph "
+             "with a recursion depth instead of a shadow stack frame and "
+             "write recursion depth histograms to profile-recursion.csv"},
+    cl::init(false),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<bool> guardHooks{
+    "guarded",
+    cl::desc{"Only run the instrumentation while profiling is enabled at run "
+             "time by CALLPROFILER_ENABLE, CALLPROFILER_TOGGLE_SIGNAL or "
+             "CaLlPrOfIlEr_enable, and skip it behind a branch otherwise"},
+    cl::init(false),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<bool> sharedLibrary{
+    "shared",
+    cl::desc{"Produce an instrumented shared library or plugin. It resolves "
+             "the runtime from the instrumented executable that loads it"},
+    cl::init(false),
+    cl::cat{callProfilerCategory}};
+
+enum RuntimeVariant {
+  singleRuntime,
+  atomicRuntime,
+  shardedRuntime,
+  samplingRuntime,
+#ifdef __linux__
+  perfRuntime
+#endif
+};
+
+static cl::opt<RuntimeVariant> runtimeVariant{
+    "runtime",
+    cl::desc{"Runtime library variant to link with the instrumented program"},
+    cl::values(
+        clEnumValN(singleRuntime, "single", "Single threaded, plain counters (default)"),
+        clEnumValN(atomicRuntime, "atomic", "Per thread call stacks, atomic counters"),
+        clEnumValN(shardedRuntime,
+                   "sharded",
+                   "Per thread call stacks and counters, merged from all "
+                   "threads when the profile is written"),
+        clEnumValN(samplingRuntime,
+                   "sampling",
+                   "Per thread call stacks, counts sampled about every "
+                   "CALLPROFILER_SAMPLE_PERIOD (default 64) events"),
+// the perf runtime library is only built where perf_event_open exists
+#ifdef __linux__
+        clEnumValN(perfRuntime,
+                   "perf",
+                   "Per thread call stacks, atomic counters, and hardware "
+                   "event costs per edge from perf_event counters"),
+#endif
+        clEnumValEnd),
+    cl::init(singleRuntime),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<bool> stripDebug{
+    "strip-debug",
+    cl::desc{"Strip debug info from the module after instrumenting it"},
+    cl::init(false),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<string> serveSocket{
+    "serve",
+    cl::desc{"Run as a server keeping LLVM and its targets initialized and "
+             "take instrumentation jobs on the given Unix socket"},
+    cl::value_desc{"socket"},
+    cl::init(""),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<string> connectSocket{
+    "connect",
+    cl::desc{"Send this instrumentation job to the server on the given Unix "
+             "socket instead of running it in this process"},
+    cl::value_desc{"socket"},
+    cl::init(""),
+    cl::cat{callProfilerCategory}};
+
+static cl::opt<unsigned> serverJobs{
+    "server-jobs",
+    cl::desc{"Maximum number of jobs a server runs in parallel "
+             "(default = number of hardware threads)"},
+    cl::init(0),
+    cl::cat{callProfilerCategory}};
 
-  Triple triple        = Triple(m.getTargetTriple());
-  Target const* target = TargetRegistry::lookupTarget(MArch, triple, err);
-  if (!target) {
-    report_fatal_error("Unable to find target:\n " + err);
+
+static void
+initializeTargets() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
   }
+  initialized = true;
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+  cl::AddExtraVersionPrinter(TargetRegistry::printRegisteredTargetsForVersion);
+}
+
 
-  CodeGenOpt::Level level = CodeGenOpt::Default;
+static CodeGenOpt::Level
+getCodeGenLevel() {
   switch (optLevel) {
     default:
       report_fatal_error("Invalid optimization level.\n");
     // No fall through
-    case '0': level = CodeGenOpt::None; break;
-    case '1': level = CodeGenOpt::Less; break;
-    case '2': level = CodeGenOpt::Default; break;
-    case '3': level = CodeGenOpt::Aggressive; break;
+    case '0': return CodeGenOpt::None;
+    case '1': return CodeGenOpt::Less;
+    case '2': return CodeGenOpt::Default;
+    case '3': return CodeGenOpt::Aggressive;
   }
+}
+
+
+static Optional<Reloc::Model>
+getOutputRelocModel() {
+  return sharedLibrary ? Reloc::PIC_ : getRelocModel();
+}
+
 
-  string FeaturesStr;
-  TargetOptions options = InitTargetOptionsFromCodeGenFlags();
-  unique_ptr<TargetMachine> machine(
-      target->createTargetMachine(triple.getTriple(),
-                                  MCPU,
-                                  FeaturesStr,
-                                  options,
-                                  getRelocModel(),
-                                  CMModel,
-                                  level));
-  assert(machine.get() && "Could not allocate target machine!");
+// Creating a TargetMachine is a large part of the cost of a job, so machines
+// are kept until main returns. A server creates the common ones up front and
+// every job it forks inherits them. They are released by main, since they
+// must not outlive llvm_shutdown().
+static std::map<string, unique_ptr<TargetMachine>> machines;
+
+
+static TargetMachine&
+getTargetMachine(const Triple& triple,
+                 CodeGenOpt::Level level,
+                 Optional<Reloc::Model> relocModel) {
+  string key = triple.getTriple() + "|" + MArch + "|" + MCPU + "|"
+               + std::to_string(level) + "|"
+               + (relocModel ? std::to_string(*relocModel) : "default");
+  auto& machine = machines[key];
+  if (!machine) {
+    string err;
+    Target const* target = TargetRegistry::lookupTarget(MArch, triple, err);
+    if (!target) {
+      report_fatal_error("Unable to find target:\n " + err);
+    }
+
+    string FeaturesStr;
+    TargetOptions options = InitTargetOptionsFromCodeGenFlags();
+    machine.reset(target->createTargetMachine(triple.getTriple(),
+                                              MCPU,
+                                              FeaturesStr,
+                                              options,
+                                              relocModel,
+                                              CMModel,
+                                              level));
+    assert(machine.get() && "Could not allocate target machine!");
+  }
 
+  // Options come from the command line of the current job.
+  machine->Options = InitTargetOptionsFromCodeGenFlags();
   if (FloatABIForCalls != FloatABI::Default) {
-    options.FloatABIType = FloatABIForCalls;
+    machine->Options.FloatABIType = FloatABIForCalls;
   }
+  return *machine;
+}
+
+
+static void
+compile(Module& m, StringRef outputPath) {
+  Triple triple = Triple(m.getTargetTriple());
+  TargetMachine* machine =
+      &getTargetMachine(triple, getCodeGenLevel(), getOutputRelocModel());
 
   std::error_code errc;
   auto out =
@@ -179,6 +325,28 @@ link(StringRef objectFile, StringRef outputFile) {
     report_fatal_error("Unable to find clang.");
   }
   vector<string> args{clang.get(), opt, "-o", outputFile, objectFile};
+  FileRemover exportsRemover;
+  if (sharedLibrary) {
+    args.push_back("-shared");
+  } else {
+    // instrumented shared libraries resolve the runtime from the executable,
+    // which only exports the runtime so that the program's own functions
+    // can't be interposed on the libraries' calls
+#ifdef __APPLE__
+    args.push_back("-rdynamic");
+#else
+    int fd;
+    SmallString<128> exports;
+    if (sys::fs::createTemporaryFile("callgraph-profiler", "exports", fd, exports)) {
+      report_fatal_error("Unable to create the export list.");
+    }
+    exportsRemover.setFile(exports);
+    raw_fd_ostream out(fd, true);
+    out << "{ CaLlPrOfIlEr_*; };\n";
+    out.close();
+    args.push_back("-Wl,--dynamic-list=" + exports.str().str());
+#endif
+  }
 
   for (auto& libPath : libPaths) {
     args.push_back("-L" + libPath);
@@ -231,6 +399,25 @@ saveModule(Module& m, StringRef filename) {
 }
 
 
+// sites are keyed by the file name of the instrumented object, which tells
+// the maps of an executable and its libraries apart
+static void
+saveSiteMap(ArrayRef<cgprofiler::SiteLocation> sites, StringRef object,
+            StringRef filename) {
+  std::error_code errc;
+  raw_fd_ostream out(filename.data(), errc, sys::fs::F_Text);
+
+  if (errc) {
+    report_fatal_error("error saving site map to '" + filename + "': \n"
+                       + errc.message());
+  }
+  for (auto& site : sites) {
+    out << object << "\t" << site.caller << "\t" << site.site << "\t" << site.filename << "\t"
+        << site.line << "\n";
+  }
+}
+
+
 static void
 prepareLinkingPaths(SmallString<32> invocationPath) {
   // First search the directory of the binary for the library, in case it is
@@ -252,47 +439,60 @@ prepareLinkingPaths(SmallString<32> invocationPath) {
   libPaths.push_back(TEMP_LIBRARY_PATH "/Debug/lib/");
   libPaths.push_back(TEMP_LIBRARY_PATH "/Release/lib/");
 #endif
-  libraries.push_back(RUNTIME_LIB);
+  if (sharedLibrary) {
+    return;
+  }
+  switch (runtimeVariant) {
+    case singleRuntime: libraries.push_back(RUNTIME_LIB); break;
+    case atomicRuntime: libraries.push_back(RUNTIME_LIB "-atomic"); break;
+    case shardedRuntime: libraries.push_back(RUNTIME_LIB "-sharded"); break;
+    case samplingRuntime: libraries.push_back(RUNTIME_LIB "-sampling"); break;
+#ifdef __linux__
+    case perfRuntime: libraries.push_back(RUNTIME_LIB "-perf"); break;
+#endif
+  }
 #ifndef __APPLE__
   libraries.push_back("rt");
+  libraries.push_back("dl");
 #endif
 }
 
 
 static void
 instrumentForDynamicCount(Module& m) {
-  InitializeAllTargets();
-  InitializeAllTargetMCs();
-  InitializeAllAsmPrinters();
-  InitializeAllAsmParsers();
-  cl::AddExtraVersionPrinter(TargetRegistry::printRegisteredTargetsForVersion);
-
-  if (outFile.getValue() == "") {
-    errs() << "-o command line option must be specified.\n";
-    exit(-1);
-  }
+  initializeTargets();
 
   // Build up all of the passes that we want to run on the module.
   legacy::PassManager pm;
-  pm.add(new cgprofiler::ProfilingInstrumentationPass());
+  auto* profiler = new cgprofiler::ProfilingInstrumentationPass(
+      !siteMapFile.empty(), collapseRecursion, guardHooks);
+  pm.add(profiler);
   pm.add(createVerifierPass());
   pm.run(m);
 
+  if (!siteMapFile.empty()) {
+    saveSiteMap(profiler->siteLocations, sys::path::filename(outFile),
+                siteMapFile);
+  }
+  if (stripDebug) {
+    StripDebugInfo(m);
+  }
+
   generateBinary(m, outFile);
   saveModule(m, outFile + ".callcounter.bc");
 }
 
 
-int
-main(int argc, char** argv) {
-  // This boilerplate provides convenient stack traces and clean LLVM exit
-  // handling. It also initializes the built in support for convenient
-  // command line option handling.
-  sys::PrintStackTraceOnErrorSignal(argv[0]);
-  llvm::PrettyStackTraceProgram X(argc, argv);
-  llvm_shutdown_obj shutdown;
-  cl::HideUnrelatedOptions(callProfilerCategory);
-  cl::ParseCommandLineOptions(argc, argv);
+static int
+instrumentFile(StringRef invocationPath) {
+  if (inPath.getValue() == "") {
+    errs() << "A bitcode file to instrument must be specified.\n";
+    return -1;
+  }
+  if (outFile.getValue() == "") {
+    errs() << "-o command line option must be specified.\n";
+    return -1;
+  }
 
   // Construct an IR file from the filename passed on the command line.
   SMDiagnostic err;
@@ -301,12 +501,75 @@ main(int argc, char** argv) {
 
   if (!module.get()) {
     errs() << "Error reading bitcode file: " << inPath << "\n";
-    err.print(argv[0], errs());
+    err.print(invocationPath.data(), errs());
     return -1;
   }
 
-  prepareLinkingPaths(StringRef(argv[0]));
+  prepareLinkingPaths(invocationPath);
   instrumentForDynamicCount(*module);
 
   return 0;
 }
+
+
+// Jobs run in processes forked from the server, so each has its own
+// LLVMContext and command line options while sharing the initialized targets.
+// Forking rather than threading also keeps a fatal error in one job from
+// taking down the others.
+static int
+serve(StringRef invocationPath) {
+  initializeTargets();
+  Triple host(sys::getDefaultTargetTriple());
+  getTargetMachine(host, getCodeGenLevel(), getRelocModel());
+  getTargetMachine(host, getCodeGenLevel(), Reloc::PIC_);
+
+  unsigned maxJobs = serverJobs;
+  if (!maxJobs) {
+    maxJobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  string program = invocationPath;
+  return cgprofiler::serve(serveSocket, maxJobs, [&](int argc, char** argv) {
+    cl::ResetAllOptionOccurrences();
+    libPaths.clear();
+    libraries.clear();
+    cl::ParseCommandLineOptions(argc, argv);
+    return instrumentFile(program);
+  });
+}
+
+
+// The client forwards its own command line, less the -connect option.
+static int
+submit(int argc, char** argv) {
+  vector<const char*> args;
+  for (int i = 0; i < argc; ++i) {
+    StringRef arg = argv[i];
+    if (arg == "-connect" || arg == "--connect") {
+      ++i;
+    } else if (!arg.startswith("-connect=") && !arg.startswith("--connect=")) {
+      args.push_back(argv[i]);
+    }
+  }
+  return cgprofiler::submit(connectSocket, args);
+}
+
+
+int
+main(int argc, char** argv) {
+  // This boilerplate provides convenient stack traces and clean LLVM exit
+  // handling. It also initializes the built in support for convenient
+  // command line option handling.
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  llvm::PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj shutdown;
+  cl::HideUnrelatedOptions(callProfilerCategory);
+  cl::ParseCommandLineOptions(argc, argv);
+
+  if (!connectSocket.empty()) {
+    return submit(argc, argv);
+  }
+  int status =
+      serveSocket.empty() ? instrumentFile(argv[0]) : serve(argv[0]);
+  machines.clear();
+  return status;
+}
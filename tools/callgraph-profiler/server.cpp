@@ -0,0 +1,286 @@
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "server.h"
+
+
+using namespace llvm;
+using std::string;
+using std::vector;
+
+
+// A request is a sequence of NUL terminated strings: the number of
+// arguments, the client's working directory, then the arguments.
+// The reply is the output of the job followed by one byte holding its exit
+// status, written by the server once the job's process has exited.
+
+
+static int
+openSocket(StringRef socketPath, sockaddr_un& address) {
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    errs() << "Socket path is too long: " << socketPath << "\n";
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, socketPath.data(), socketPath.size());
+  return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+
+// jobs exec other programs, which must not keep the connections of other
+// jobs open: a client only sees the end of its reply once every process
+// holding its connection has exited
+static void
+closeOnExec(int fd) {
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+static bool
+writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+
+static bool
+readString(int fd, string& str) {
+  str.clear();
+  char c;
+  while (true) {
+    ssize_t n = read(fd, &c, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    if (c == '\0') {
+      return true;
+    }
+    str.push_back(c);
+  }
+}
+
+
+// write end of the pipe waking the server up when a job exits
+static int childExited = -1;
+
+static void
+onChildExit(int) {
+  int saved = errno;
+  char c = 0;
+  (void)write(childExited, &c, 1);
+  errno = saved;
+}
+
+
+// Runs in the forked child: read the request, then run the job with its
+// output going to the client.
+static int
+runRequest(int connection, function_ref<int(int, char**)> runJob) {
+  string count, cwd;
+  if (!readString(connection, count) || !readString(connection, cwd)) {
+    return 1;
+  }
+  vector<string> args(strtoul(count.c_str(), nullptr, 10));
+  for (auto& arg : args) {
+    if (!readString(connection, arg)) {
+      return 1;
+    }
+  }
+  if (args.empty() || chdir(cwd.c_str()) != 0) {
+    return 1;
+  }
+
+  dup2(connection, STDOUT_FILENO);
+  dup2(connection, STDERR_FILENO);
+  close(connection);
+
+  vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+  int status = runJob(static_cast<int>(args.size()), argv.data());
+  outs().flush();
+  errs().flush();
+  return status;
+}
+
+
+int
+cgprofiler::serve(StringRef socketPath,
+                  unsigned maxJobs,
+                  function_ref<int(int, char**)> runJob) {
+  sockaddr_un address;
+  int listener = openSocket(socketPath, address);
+  if (listener < 0) {
+    return 1;
+  }
+  closeOnExec(listener);
+  // replace the socket of an earlier server, but never any other file
+  struct stat existing;
+  if (lstat(address.sun_path, &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      errs() << "Not a socket, refusing to replace: " << socketPath << "\n";
+      return 1;
+    }
+    sys::fs::remove(socketPath);
+  }
+  // jobs run as the server's user, so only that user may connect
+  mode_t mask = umask(0177);
+  int bound =
+      bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  umask(mask);
+  if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+    errs() << "Unable to listen on " << socketPath << ": " << strerror(errno)
+           << "\n";
+    return 1;
+  }
+
+  int exits[2];
+  if (pipe(exits) != 0) {
+    return 1;
+  }
+  closeOnExec(exits[0]);
+  closeOnExec(exits[1]);
+  childExited = exits[1];
+  signal(SIGCHLD, onChildExit);
+
+  // connection of every running job, to send its status once it exits
+  std::map<pid_t, int> running;
+  while (true) {
+    pollfd fds[2] = {{exits[0], POLLIN, 0}, {listener, POLLIN, 0}};
+    nfds_t numFds = running.size() < maxJobs ? 2 : 1;
+    if (poll(fds, numFds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char drained[64];
+      (void)read(exits[0], drained, sizeof(drained));
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto job = running.find(pid);
+        if (job == running.end()) {
+          continue;
+        }
+        char exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        writeAll(job->second, &exitCode, 1);
+        close(job->second);
+        running.erase(job);
+      }
+    }
+
+    if (numFds > 1 && (fds[1].revents & POLLIN)) {
+      int connection = accept(listener, nullptr, nullptr);
+      if (connection < 0) {
+        continue;
+      }
+      closeOnExec(connection);
+      pid_t pid = fork();
+      if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        close(listener);
+        close(exits[0]);
+        close(exits[1]);
+        for (auto& job : running) {
+          close(job.second);
+        }
+        _exit(runRequest(connection, runJob));
+      }
+      if (pid < 0) {
+        char exitCode = 1;
+        writeAll(connection, &exitCode, 1);
+        close(connection);
+        continue;
+      }
+      running[pid] = connection;
+    }
+  }
+}
+
+
+int
+cgprofiler::submit(StringRef socketPath, ArrayRef<const char*> args) {
+  sockaddr_un address;
+  int connection = openSocket(socketPath, address);
+  if (connection < 0) {
+    return 1;
+  }
+  if (connect(
+          connection, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+      != 0) {
+    errs() << "Unable to connect to " << socketPath << ": " << strerror(errno)
+           << "\n";
+    return 1;
+  }
+
+  SmallString<128> cwd;
+  sys::fs::current_path(cwd);
+  string request = std::to_string(args.size());
+  request.push_back('\0');
+  request.append(cwd.begin(), cwd.end());
+  request.push_back('\0');
+  for (auto* arg : args) {
+    request.append(arg);
+    request.push_back('\0');
+  }
+  if (!writeAll(connection, request.data(), request.size())) {
+    return 1;
+  }
+
+  // relay everything but the trailing status byte
+  string reply;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(connection, buffer, sizeof(buffer))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    reply.append(buffer, n);
+    if (reply.size() > 1) {
+      outs() << StringRef(reply).drop_back();
+      reply.erase(0, reply.size() - 1);
+    }
+  }
+  close(connection);
+  outs().flush();
+  return reply.empty() ? 1 : static_cast<unsigned char>(reply.back());
+}
@@ -0,0 +1,30 @@
+
+#ifndef CALLPROFILER_SERVER_H
+#define CALLPROFILER_SERVER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+
+
+namespace cgprofiler {
+
+
+// Accept instrumentation jobs on the Unix socket at socketPath. Every job is
+// run by runJob with the client's command line in a child forked from the
+// warm server process, so that LLVM startup and target setup are paid once.
+// At most maxJobs children run at a time. Only returns on error.
+int serve(llvm::StringRef socketPath,
+          unsigned maxJobs,
+          llvm::function_ref<int(int, char**)> runJob);
+
+
+// Run the command line args as a job of the server at socketPath, relaying
+// its output. Returns the exit status of the job.
+int submit(llvm::StringRef socketPath, llvm::ArrayRef<const char*> args);
+
+
+}  // namespace cgprofiler
+
+
+#endif